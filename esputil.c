@@ -24,10 +24,13 @@
 #ifdef _WIN32  // Windows includes
 #include <direct.h>
 #include <io.h>
+#include <process.h>
 #include <windows.h>
 #include <winsock2.h>
 #define strcasecmp(x, y) _stricmp((x), (y))
+#define strncasecmp(x, y, n) _strnicmp((x), (y), (n))
 #define mkdir(x, y) _mkdir(x)
+#define getpid() _getpid()
 #if defined(_MSC_VER) && _MSC_VER < 1700
 #define snprintf _snprintf
 #define inline __inline
@@ -50,6 +53,7 @@ typedef enum { false = 0, true = 1 } bool;
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <termios.h>
 #include <unistd.h>
 #endif
@@ -81,6 +85,13 @@ struct chip {
 #define CHIP_ID_ESP32_C6_BETA 0x0da1806f
   const char *name;  // Chpi name, e.g. "ESP32-S2"
   uint32_t bla;      // Bootloader flash offset
+  uint32_t efuse;    // eFuse registers base address, 0 if unknown
+};
+
+struct part {
+  char label[17];         // Partition label, e.g. "nvs"
+  uint8_t type, subtype;  // Type: 0 - app, 1 - data, and subtype
+  uint32_t offset, size;  // Flash region
 };
 
 struct ctx {
@@ -89,23 +100,50 @@ struct ctx {
   const char *port;        // Serial port, e.g. "/dev/ttyUSB0"
   const char *fpar;        // Flash params, e.g. "0x220"
   const char *fspi;        // Flash SPI pins: CLK,Q,D,HD,CS. E.g. "6,17,8,11,16"
+  const char *ovl;         // Per-device overlay, e.g. "0x9000,devices.csv"
+  uint8_t *ovlbuf;         // Overlay data, loaded by flash()
+  size_t ovllen;           // Overlay data length
+  uint32_t ovladdr;        // Overlay flash address
+  bool ovlpatched;         // Overlay is patched into a base image
+  bool verify;             // Verify flashed data using on-device MD5
+  bool xip;                // mkbin: align flash-mapped segments for the MMU
+  bool ifchanged;          // Do not flash images that are already on device
+  const char *out;         // Output file for commands that dump data
+  bool resume;             // Resume interrupted dump into the output file
+  bool sparse;             // Do not fetch blank flash blocks
+  bool full;               // Print full device info, including eFuse
+  bool json;               // Print device info as JSON
+  int interval;            // Sampling interval in milliseconds
+  int recsize;             // Intel HEX record size
+  const char *store;       // Backup store directory
+  const char *cache;       // mkbin: directory for caching generated images
+  const char *img;         // flash: compose flash image file, no device
+  size_t imgsize;          // Flash image size
+  uint8_t *imgbuf;         // Flash image contents
+  const char *pt;          // Partition table: flash address or file name
+  struct part *parts;      // Partition table, loaded on demand
+  size_t nparts;           // Number of partitions
+  const char *stubfile;    // Flasher stub ELF file, uploaded into RAM
+  bool stub;               // Flasher stub is running
   bool verbose;            // Hexdump serial comms
   int fd;                  // Serial port file descriptor
   int sock;                // UDP socket for exchanging SLIP frames when monitor
   struct sockaddr_in sin;  // UDP sockaddr of the remote peer
   struct chip chip;        // Chip descriptor
+  uint8_t rx[2048];        // Serial read buffer
+  size_t rxlen, rxofs;     // Number of bytes in rx, and bytes processed
 };
 
 static struct chip s_known_chips[] = {
-    {0, "Unknown", 0},
-    {CHIP_ID_ESP8266, "ESP8266", 0},
-    {CHIP_ID_ESP32, "ESP32", 4096},
-    {CHIP_ID_ESP32_C3_ECO_1_2, "ESP32-C3-ECO2", 0},
-    {CHIP_ID_ESP32_C3_ECO3, "ESP32-C3-ECO3", 0},
-    {CHIP_ID_ESP32_S2, "ESP32-S2", 4096},
-    {CHIP_ID_ESP32_S3_BETA2, "ESP32-S3-BETA2", 0},
-    {CHIP_ID_ESP32_S3_BETA3, "ESP32-S3-BETA3", 0},
-    {CHIP_ID_ESP32_C6_BETA, "ESP32-C6-BETA", 0},
+    {0, "Unknown", 0, 0},
+    {CHIP_ID_ESP8266, "ESP8266", 0, 0x3ff00050},
+    {CHIP_ID_ESP32, "ESP32", 4096, 0x3ff5a000},
+    {CHIP_ID_ESP32_C3_ECO_1_2, "ESP32-C3-ECO2", 0, 0x60008800},
+    {CHIP_ID_ESP32_C3_ECO3, "ESP32-C3-ECO3", 0, 0x60008800},
+    {CHIP_ID_ESP32_S2, "ESP32-S2", 4096, 0x3f41a000},
+    {CHIP_ID_ESP32_S3_BETA2, "ESP32-S3-BETA2", 0, 0x60007000},
+    {CHIP_ID_ESP32_S3_BETA3, "ESP32-S3-BETA3", 0, 0x60007000},
+    {CHIP_ID_ESP32_C6_BETA, "ESP32-C6-BETA", 0, 0},
 };
 
 static int s_signo;
@@ -208,17 +246,44 @@ static void uart_tx(unsigned char ch, void *arg) {
 static void usage(struct ctx *ctx) {
   printf("Defaults: BAUD=%s, PORT=%s\n", ctx->baud, ctx->port);
   printf("Usage:\n");
-  printf("  esputil [-v] [-b BAUD] [-p PORT] info\n");
+  printf("  esputil [-v] [-b BAUD] [-p PORT] [-full] [-json] info\n");
   printf("  esputil [-v] [-b BAUD] [-p PORT] [-udp PORT] monitor\n");
-  printf("  esputil [-v] [-b BAUD] [-p PORT] readmem ADDR SIZE\n");
-  printf("  esputil [-v] [-b BAUD] [-p PORT] readflash ADDR SIZE\n");
+  printf("  esputil [-v] [-b BAUD] [-p PORT] [-o FILE] readmem ADDR SIZE\n");
+  printf("  esputil [-v] [-b BAUD] [-p PORT] [-interval MS] [-o FILE] ");
+  printf("sample ADDR1,ADDR2,... [COUNT]\n");
+  printf("  esputil [-v] [-b BAUD] [-p PORT] [-o FILE [-resume] [-verify]] ");
+  printf("[-sparse] readflash ADDR SIZE\n");
+  printf("  esputil [-v] [-b BAUD] [-p PORT] [-o FILE [-resume] [-verify]] ");
+  printf("[-sparse] [-pt ADDR|FILE] readflash PARTITION\n");
   printf("  esputil [-v] [-b BAUD] [-p PORT] [-fp FLASH_PARAMS] ");
-  printf("[-fspi FLASH_SPI] flash ADDrESS1 FILE1.bin ...\n");
+  printf("[-fspi FLASH_SPI] [-ov ADDR,OVERLAY] [-verify] [-ifchanged] ");
+  printf("flash ADDRESS1 FILE1.bin|FILE1.elf ...\n");
   printf("  esputil [-v] [-b BAUD] [-p PORT] [-fp FLASH_PARAMS] ");
-  printf("[-fspi FLASH_SPI] flash FILE.HEX\n");
-  printf("  esputil [-v] [-chip detect] mkbin FIRMWARE.ELF FIRMWARE.BIN\n");
-  printf("  esputil mkhex ADDRESS1 BINFILE1 ADDRESS2 BINFILE2 ...\n");
+  printf("[-fspi FLASH_SPI] [-ov ADDR,OVERLAY] [-verify] [-ifchanged] ");
+  printf("flash FILE.HEX|FILE.bundle\n");
+  printf("  esputil -chip CHIP -img FILE.img [-fsize SIZE] ");
+  printf("[-fp FLASH_PARAMS] flash ...\n");
+  printf("  esputil [-v] [-b BAUD] [-p PORT] [-fp FLASH_PARAMS] ");
+  printf("[-fspi FLASH_SPI] verify ADDRESS1 FILE1.bin ...\n");
+  printf("  esputil [-v] [-b BAUD] [-p PORT] [-store DIR] [-o MANIFEST] ");
+  printf("backup ADDR SIZE\n");
+  printf("  esputil [-v] [-b BAUD] [-p PORT] [-store DIR] restore MANIFEST\n");
+  printf("  esputil [-v] [-b BAUD] [-p PORT] erase ADDR SIZE\n");
+  printf("  esputil [-v] [-b BAUD] [-p PORT] [-pt ADDR|FILE] ");
+  printf("erase PARTITION\n");
+  printf("  esputil [-v] [-b BAUD] [-p PORT] -stub STUB.ELF erase all\n");
+  printf("  esputil [-v] [-b BAUD] [-p PORT] run FIRMWARE.ELF\n");
+  printf("  esputil [-v] [-chip detect] [-xip] [-cache DIR] ");
+  printf("mkbin FIRMWARE.ELF FIRMWARE.BIN\n");
+  printf("  esputil [-r RECORD_SIZE] [-o FILE] ");
+  printf("mkhex ADDRESS1 BINFILE1 ADDRESS2 BINFILE2 ...\n");
   printf("  esputil [-tmp TMP_DIR] unhex HEXFILE\n");
+  printf("  esputil mkbundle BUNDLE ADDRESS1 BINFILE1 ADDRESS2 BINFILE2 ...\n");
+  printf("  esputil [-tmp TMP_DIR] unbundle BUNDLE\n");
+  printf("Commands that access flash accept [-stub STUB.ELF] option, ");
+  printf("see README.md\n");
+  printf("Flash addresses can be partition names, e.g. nvs or app:ota_0. ");
+  printf("Partition table is read from\n[-pt ADDR|FILE], 0x8000 by default\n");
   exit(EXIT_FAILURE);
 }
 
@@ -251,6 +316,10 @@ static const char *cmdstr(int code) {
     case 13: return "SPI_ATTACH";
     case 14: return "READ_FLASH_SLOW";
     case 15: return "CHANGE_BAUD_RATE";
+    case 19: return "SPI_FLASH_MD5";
+    case 0xd0: return "ERASE_FLASH";
+    case 0xd1: return "ERASE_REGION";
+    case 0xd2: return "READ_FLASH";
     default: return "CMD_UNKNOWN";
   }
 }
@@ -265,6 +334,89 @@ static uint8_t checksum(const uint8_t *buf, size_t len) {
   return checksum2(0xef, buf, len);
 }
 
+// MD5, RFC 1321. Used to compare host data with the SPI_FLASH_MD5 digests
+struct md5 {
+  uint32_t h[4];    // Hash state
+  uint64_t len;     // Number of bytes hashed so far
+  uint8_t buf[64];  // Partial input block
+};
+
+static void md5_block(uint32_t h[4], const uint8_t *p) {
+  static const uint32_t k[64] = {
+      0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+      0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+      0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+      0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+      0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+      0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+      0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+      0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+      0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+      0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+      0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+  static const uint8_t r[4][4] = {
+      {7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21}};
+  uint32_t w[16], a = h[0], b = h[1], c = h[2], d = h[3], f, t;
+  int i, g;
+  for (i = 0; i < 16; i++) {
+    w[i] = p[i * 4] | (p[i * 4 + 1] << 8) | (p[i * 4 + 2] << 16) |
+           ((uint32_t) p[i * 4 + 3] << 24);
+  }
+  for (i = 0; i < 64; i++) {
+    if (i < 16) {
+      f = (b & c) | (~b & d), g = i;
+    } else if (i < 32) {
+      f = (d & b) | (~d & c), g = (5 * i + 1) % 16;
+    } else if (i < 48) {
+      f = b ^ c ^ d, g = (3 * i + 5) % 16;
+    } else {
+      f = c ^ (b | ~d), g = (7 * i) % 16;
+    }
+    t = d, d = c, c = b;
+    f += a + k[i] + w[g];
+    b += (f << r[i / 16][i % 4]) | (f >> (32 - r[i / 16][i % 4]));
+    a = t;
+  }
+  h[0] += a, h[1] += b, h[2] += c, h[3] += d;
+}
+
+static void md5_init(struct md5 *m) {
+  m->h[0] = 0x67452301, m->h[1] = 0xefcdab89;
+  m->h[2] = 0x98badcfe, m->h[3] = 0x10325476;
+  m->len = 0;
+}
+
+static void md5_update(struct md5 *m, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *) data;
+  size_t n = (size_t) (m->len % 64);
+  m->len += len;
+  if (n > 0) {
+    size_t k = len < 64 - n ? len : 64 - n;
+    memcpy(m->buf + n, p, k);
+    p += k, len -= k, n += k;
+    if (n < 64) return;
+    md5_block(m->h, m->buf);
+  }
+  for (; len >= 64; p += 64, len -= 64) md5_block(m->h, p);
+  memcpy(m->buf, p, len);
+}
+
+static void md5_final(struct md5 *m, uint8_t digest[16]) {
+  uint8_t pad[72] = {0x80};
+  uint64_t bits = m->len * 8;
+  size_t i, n = (size_t) (m->len % 64), padlen = n < 56 ? 56 - n : 120 - n;
+  for (i = 0; i < 8; i++) pad[padlen + i] = (uint8_t) (bits >> (i * 8));
+  md5_update(m, pad, padlen + 8);
+  for (i = 0; i < 16; i++) digest[i] = (uint8_t) (m->h[i / 4] >> (i % 4 * 8));
+}
+
+static void md5(const void *data, size_t len, uint8_t digest[16]) {
+  struct md5 m;
+  md5_init(&m);
+  md5_update(&m, data, len);
+  md5_final(&m, digest);
+}
+
 #ifdef _WIN32  // Windows - specific routines
 static void sleep_ms(int milliseconds) {
   Sleep(milliseconds);
@@ -310,17 +462,21 @@ static bool is_ready(int fd) {
   return cs.cbInQue > 0;
 }
 
-static int iowait(int fd, int sock, int ms) {
+static int iowait(int fd, int sock, int ms, int mask) {
   DWORD errors, flags = 0;
   int i;
   for (i = 0; i < ms && flags == 0; i++) {
-    if (is_ready(fd)) flags |= READY_SERIAL;
-    if (is_ready(0)) flags |= READY_STDIN;
+    if ((mask & READY_SERIAL) && is_ready(fd)) flags |= READY_SERIAL;
+    if ((mask & READY_STDIN) && is_ready(0)) flags |= READY_STDIN;
     if (flags == 0) sleep_ms(1);
   }
   return flags;
 }
 
+static unsigned long now_ms(void) {
+  return GetTickCount();
+}
+
 static void set_rts(int fd, bool value) {
   EscapeCommFunction((HANDLE) _get_osfhandle(fd), value ? SETRTS : CLRRTS);
 }
@@ -405,21 +561,28 @@ static int open_serial(const char *name, int baud, bool verbose) {
   return fd;
 }
 
-// Return true if port is readable (has data), false otherwise
-static int iowait(int fd, int sock, int ms) {
+// Wait for data on any of the READY_* sources specified by the `mask`.
+// Return a READY_* mask of sources that have data
+static int iowait(int fd, int sock, int ms, int mask) {
   int ready = 0;
   struct timeval tv = {.tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000};
   fd_set rset;
   FD_ZERO(&rset);
-  FD_SET(0, &rset);   // Listen to stdin too
-  FD_SET(fd, &rset);  // Listen to the UART fd
-  if (sock > 0) FD_SET(sock, &rset);
+  if (mask & READY_STDIN) FD_SET(0, &rset);    // Listen to stdin
+  if (mask & READY_SERIAL) FD_SET(fd, &rset);  // Listen to the UART fd
+  if ((mask & READY_SOCK) && sock > 0) FD_SET(sock, &rset);
   if (select((fd > sock ? fd : sock) + 1, &rset, 0, 0, &tv) < 0) FD_ZERO(&rset);
   if (FD_ISSET(0, &rset)) ready |= READY_STDIN;
   if (FD_ISSET(fd, &rset)) ready |= READY_SERIAL;
   if (sock > 0 && FD_ISSET(sock, &rset)) ready |= READY_SOCK;
   return ready;
 }
+
+static unsigned long now_ms(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (unsigned long) tv.tv_sec * 1000 + (unsigned long) tv.tv_usec / 1000;
+}
 #endif  // End of UNIX-specific routines
 
 static void hard_reset(int fd) {
@@ -455,42 +618,118 @@ static void reset_to_bootloader(int fd) {
   set_dtr(fd, false);  // IO0 -> HIGH
 }
 
-// Execute serial command.
-// Return 0 on sucess, or error code on failure
-static int cmd(struct ctx *ctx, uint8_t op, void *buf, uint16_t len,
-               uint32_t cs, int timeout_ms) {
-  uint8_t tmp[8 + 16384];     // 8 is size of the header
-  memset(tmp, 0, 8);          // Clear header
-  tmp[1] = op;                // Operation
-  memcpy(&tmp[2], &len, 2);   // Length
-  memcpy(&tmp[4], &cs, 4);    // Checksum
-  memcpy(&tmp[8], buf, len);  // Data
+// Send serial command, do not wait for the response
+static void cmd_send(struct ctx *ctx, uint8_t op, const void *buf,
+                     uint16_t len, uint32_t cs) {
+  uint8_t tmp[8 + 16 + 16384];  // Header, data command header, data
+  memset(tmp, 0, 8);            // Clear header
+  tmp[1] = op;                  // Operation
+  memcpy(&tmp[2], &len, 2);     // Length
+  memcpy(&tmp[4], &cs, 4);      // Checksum
+  memcpy(&tmp[8], buf, len);    // Data
 
   slip_send(tmp, 8 + len, uart_tx, &ctx->fd);        // Send command
   if (ctx->verbose) dump(cmdstr(op), tmp, 8 + len);  // Hexdump if required
+}
 
+// Wait for the next SLIP frame from the device. The frame is in
+// ctx->slip.buf. Return frame length, or 0 on timeout
+static size_t frame_recv(struct ctx *ctx, long timeout_ms) {
+  unsigned long deadline = now_ms() + (unsigned long) timeout_ms;
   for (;;) {
-    int i, n, ready, eofs, ecode;
-    ready = iowait(ctx->fd, ctx->sock, timeout_ms);  // Wait for data
-    if (!(ready & READY_SERIAL)) return 1;           // Interrupted, fail
-    n = read(ctx->fd, tmp, sizeof(tmp));             // Read from a device
-    if (n <= 0) fail("Serial line closed\n");        // Doh. Unplugged maybe?
-    // if (ctx->verbose) dump("--RAW_RESPONSE:", tmp, n);
-    for (i = 0; i < n; i++) {
-      size_t r = slip_recv(tmp[i], &ctx->slip);  // Pass to SLIP state machine
-      // if (r == 0 && ctx->slip.mode == 0) putchar(tmp[i]);  // In serial mode
+    int n;
+    long ms = (long) (deadline - now_ms());
+    // Feed buffered serial data into SLIP state machine, until full frame
+    while (ctx->rxofs < ctx->rxlen) {
+      size_t r = slip_recv(ctx->rx[ctx->rxofs++], &ctx->slip);
       if (r == 0) continue;
       if (ctx->verbose) dump("--SLIP_RESPONSE:", ctx->slip.buf, r);
-      if (r < 10 || ctx->slip.buf[0] != 1 || ctx->slip.buf[1] != op) continue;
-      // ESP8266's error indicator is in the 2 last bytes, ESP32's - last 4
-      eofs =
-          ctx->chip.id == 0 || ctx->chip.id == CHIP_ID_ESP8266 ? r - 2 : r - 4;
-      ecode = ctx->slip.buf[eofs] ? ctx->slip.buf[eofs + 1] : 0;
-      if (ecode) printf("error %d: %s\n", ecode, ecode_to_str(ecode));
-      return ecode;
+      return r;
+    }
+    if (ms <= 0 || s_signo) return 0;                           // Timeout
+    if (!(iowait(ctx->fd, ctx->sock, (int) ms, READY_SERIAL) & READY_SERIAL))
+      continue;                                                 // No data yet
+    n = read(ctx->fd, ctx->rx, sizeof(ctx->rx));  // Read from a device
+    if (n <= 0) fail("Serial line closed\n");     // Doh. Unplugged maybe?
+    ctx->rxlen = (size_t) n, ctx->rxofs = 0;
+  }
+}
+
+// Wait for the response to the command `op`. The response is in
+// ctx->slip.buf. Return 0 on sucess, or error code on failure
+static int cmd_recv(struct ctx *ctx, uint8_t op, int timeout_ms) {
+  unsigned long deadline = now_ms() + (unsigned long) timeout_ms;
+  size_t r;
+  while ((r = frame_recv(ctx, (long) (deadline - now_ms()))) > 0) {
+    int eofs, ecode;
+    if (r < 10 || ctx->slip.buf[0] != 1 || ctx->slip.buf[1] != op) continue;
+    // Error indicator is in the 2 last bytes for ESP8266 and for the stub,
+    // ESP32's ROM uses the last 4
+    eofs = ctx->chip.id == 0 || ctx->chip.id == CHIP_ID_ESP8266 || ctx->stub
+               ? (int) r - 2
+               : (int) r - 4;
+    ecode = ctx->slip.buf[eofs] ? ctx->slip.buf[eofs + 1] : 0;
+    if (ecode) fprintf(stderr, "error %d: %s\n", ecode, ecode_to_str(ecode));
+    return ecode;
+  }
+  return 1;  // Timeout
+}
+
+// Discard all serial data, including the data that is still arriving
+static void cmd_drain(struct ctx *ctx) {
+  while (iowait(ctx->fd, ctx->sock, 100, READY_SERIAL) & READY_SERIAL) {
+    if (read(ctx->fd, ctx->rx, sizeof(ctx->rx)) <= 0) break;
+  }
+  ctx->rxlen = ctx->rxofs = 0;
+}
+
+// Execute serial command.
+// Return 0 on sucess, or error code on failure
+static int cmd(struct ctx *ctx, uint8_t op, void *buf, uint16_t len,
+               uint32_t cs, int timeout_ms) {
+  cmd_send(ctx, op, buf, len, cs);
+  return cmd_recv(ctx, op, timeout_ms);
+}
+
+// Execute `count` commands `op`, keeping up to `window` of them in flight.
+// Function `req` fills in the payload for the i-th command and returns its
+// length, `resp` is called with the response for every i-th command, in
+// order. The device executes commands and responds strictly in order, so
+// responses are matched to the queued requests by their sequence.
+// If a command fails, drop the responses in flight and continue in
+// stop-and-wait mode. Return the number of completed commands
+static size_t cmd_pipeline(struct ctx *ctx, uint8_t op, size_t count,
+                           size_t window, int timeout_ms,
+                           uint16_t (*req)(size_t i, void *buf, void *arg),
+                           void (*resp)(size_t i, uint8_t *buf, void *arg),
+                           void *arg) {
+  uint8_t buf[16 + 0x1800];  // Large enough for MEM_DATA
+  size_t sent = 0, done = 0;
+  while (done < count && s_signo == 0) {
+    for (; sent < count && sent - done < window; sent++) {
+      uint16_t len = req(sent, buf, arg);
+      // Data commands carry a checksum of the data past the 16-byte header
+      uint32_t cs = op == 3 || op == 7 ? checksum(buf + 16, len - 16U) : 0;
+      cmd_send(ctx, op, buf, len, cs);
+    }
+    if (cmd_recv(ctx, op, timeout_ms) == 0) {
+      resp(done++, ctx->slip.buf, arg);
+    } else if (window > 1) {
+      if (ctx->verbose) printf("%s failed, retrying\n", cmdstr(op));
+      cmd_drain(ctx);
+      sent = done, window = 1;
+    } else {
+      break;
     }
   }
-  return 42;
+  return done;
+}
+
+// Print transfer speed on stderr, because stdout may carry the data
+static void report_speed(const char *what, uint32_t size, unsigned long t) {
+  unsigned long ms = now_ms() - t;
+  fprintf(stderr, "%s %u bytes in %lu ms, %lu KB/s\n", what, size, ms,
+          ms == 0 ? 0 : (unsigned long) ((double) size * 1000 / 1024 / ms));
 }
 
 static int read32(struct ctx *ctx, uint32_t addr, uint32_t *value) {
@@ -530,12 +769,14 @@ static bool chip_connect(struct ctx *ctx) {
       reset_to_bootloader(ctx->fd);
     }
     flushio(ctx->fd);
+    ctx->rxlen = ctx->rxofs = 0;
     for (i = 0; i < 2 + j; i++) {
       uint8_t data[36] = {7, 7, 0x12, 0x20};     // SYNC command
       memset(data + 4, 0x55, sizeof(data) - 4);  // Fill with 0x55
       if (cmd(ctx, 8, data, sizeof(data), 0, 100) == 0) {
         sleep_ms(50);
         flushio(ctx->fd);  // Discard all data
+        ctx->rxlen = ctx->rxofs = 0;
         chip_detect(ctx);
         return true;
       }
@@ -560,7 +801,8 @@ static void set_chip_id(struct ctx *ctx, const char *name) {
 }
 
 static void monitor(struct ctx *ctx) {
-  int i, ready = iowait(ctx->fd, ctx->sock, 1000);
+  int i, ready = iowait(ctx->fd, ctx->sock, 1000,
+                       READY_STDIN | READY_SERIAL | READY_SOCK);
   if (ready & READY_SERIAL) {
     uint8_t buf[BUFSIZ];
     int n = read(ctx->fd, buf, sizeof(buf));   // Read from a device
@@ -597,17 +839,219 @@ static void monitor(struct ctx *ctx) {
   }
 }
 
+static int has_suffix(const char *word, const char *suffix) {
+  size_t word_len = strlen(word), suffix_len = strlen(suffix);
+  return word_len > suffix_len &&
+         strcasecmp(&word[word_len - suffix_len], suffix) == 0;
+}
+
+struct rdmem {
+  uint32_t base;          // Memory region address
+  const uint32_t *addrs;  // Addresses to read, used instead of base if set
+  uint8_t *buf;           // Output buffer
+};
+
+static uint16_t rdmem_req(size_t i, void *buf, void *arg) {
+  struct rdmem *r = (struct rdmem *) arg;
+  uint32_t addr = r->addrs ? r->addrs[i] : r->base + (uint32_t) i * 4;
+  memcpy(buf, &addr, sizeof(addr));
+  return sizeof(addr);
+}
+
+static void rdmem_resp(size_t i, uint8_t *buf, void *arg) {
+  memcpy(((struct rdmem *) arg)->buf + i * 4, &buf[4], 4);
+}
+
+// Read `count` 32-bit words starting from `addr`, keeping several READ_REG
+// requests in flight. Return number of words read
+static size_t read_words(struct ctx *ctx, uint32_t addr, uint32_t *buf,
+                         size_t count) {
+  struct rdmem r;
+  r.base = addr, r.addrs = NULL, r.buf = (uint8_t *) buf;
+  // Framed READ_REG request takes up to 18 bytes, and ROM UART FIFO is 128
+  // bytes, thus up to 7 requests fit. Keep 6 in flight
+  return cmd_pipeline(ctx, 10, count, 6, 100, rdmem_req, rdmem_resp, &r);
+}
+
+// Same as read_words(), but read words from a list of addresses
+static size_t read_words_at(struct ctx *ctx, const uint32_t *addrs,
+                            uint32_t *buf, size_t count) {
+  struct rdmem r;
+  r.base = 0, r.addrs = addrs, r.buf = (uint8_t *) buf;
+  return cmd_pipeline(ctx, 10, count, 6, 100, rdmem_req, rdmem_resp, &r);
+}
+
+struct efuse_field {
+  const char *name;         // Field name, e.g. "pkg_version"
+  uint16_t ofs;             // Register offset from the eFuse base
+  uint8_t shift, bits;      // Bit position and width
+};
+
+struct efuse_layout {
+  uint32_t id;                       // Chip ID
+  uint16_t size;                     // Size of eFuse read registers, bytes
+  uint16_t mac;                      // MAC registers offset
+  const struct efuse_field *fields;  // Decoded fields, NULL-terminated
+};
+
+// clang-format off
+static const struct efuse_field s_esp32_efuse[] = {
+  {"wr_dis", 0x00, 0, 16}, {"rd_dis", 0x00, 16, 4},
+  {"flash_crypt_cnt", 0x00, 20, 7}, {"uart_download_dis", 0x00, 27, 1},
+  {"dis_app_cpu", 0x0c, 0, 1}, {"dis_bt", 0x0c, 1, 1},
+  {"chip_package", 0x0c, 9, 3}, {"chip_package_4bit", 0x0c, 2, 1},
+  {"chip_ver_rev1", 0x0c, 15, 1}, {"chip_ver_rev2", 0x14, 20, 1},
+  {"flash_crypt_config", 0x14, 28, 4}, {"coding_scheme", 0x18, 0, 2},
+  {"console_debug_disable", 0x18, 2, 1}, {"abs_done_0", 0x18, 4, 1},
+  {"abs_done_1", 0x18, 5, 1}, {"jtag_disable", 0x18, 6, 1},
+  {"disable_dl_encrypt", 0x18, 7, 1}, {"disable_dl_decrypt", 0x18, 8, 1},
+  {"disable_dl_cache", 0x18, 9, 1},
+  {NULL, 0, 0, 0}};
+
+static const struct efuse_field s_esp32s2_efuse[] = {
+  {"rd_dis", 0x30, 0, 7}, {"hard_dis_jtag", 0x30, 18, 1},
+  {"dis_download_manual_encrypt", 0x30, 19, 1},
+  {"spi_boot_crypt_cnt", 0x34, 18, 3}, {"secure_boot_en", 0x38, 20, 1},
+  {"dis_download_mode", 0x3c, 0, 1},
+  {"wafer_version_major", 0x50, 18, 2}, {"wafer_version_minor_hi", 0x50, 20, 1},
+  {"flash_version", 0x50, 21, 4}, {"psram_version", 0x50, 28, 4},
+  {"pkg_version", 0x54, 0, 4}, {"wafer_version_minor_lo", 0x54, 4, 3},
+  {NULL, 0, 0, 0}};
+
+// ESP32-C3 and ESP32-S3 share the register map
+static const struct efuse_field s_esp32c3_efuse[] = {
+  {"rd_dis", 0x30, 0, 7}, {"dis_pad_jtag", 0x30, 19, 1},
+  {"dis_download_manual_encrypt", 0x30, 20, 1},
+  {"spi_boot_crypt_cnt", 0x34, 18, 3}, {"secure_boot_en", 0x38, 20, 1},
+  {"dis_download_mode", 0x3c, 0, 1},
+  {"wafer_version_minor_lo", 0x50, 18, 3}, {"pkg_version", 0x50, 21, 3},
+  {"blk_version_minor", 0x50, 24, 3}, {"flash_cap", 0x50, 27, 3},
+  {"flash_vendor", 0x54, 0, 3}, {"psram_cap", 0x54, 3, 2},
+  {"psram_vendor", 0x54, 7, 2}, {"wafer_version_minor_hi", 0x58, 23, 1},
+  {"wafer_version_major", 0x58, 24, 2},
+  {NULL, 0, 0, 0}};
+
+static const struct efuse_field s_esp8266_efuse[] = {{NULL, 0, 0, 0}};
+
+static const struct efuse_layout s_efuse_layouts[] = {
+  {CHIP_ID_ESP8266, 0x10, 0, s_esp8266_efuse},
+  {CHIP_ID_ESP32, 0x98, 0x04, s_esp32_efuse},
+  {CHIP_ID_ESP32_S2, 0x180, 0x44, s_esp32s2_efuse},
+  {CHIP_ID_ESP32_C3_ECO_1_2, 0x180, 0x44, s_esp32c3_efuse},
+  {CHIP_ID_ESP32_C3_ECO3, 0x180, 0x44, s_esp32c3_efuse},
+  {CHIP_ID_ESP32_S3_BETA2, 0x180, 0x44, s_esp32c3_efuse},
+  {CHIP_ID_ESP32_S3_BETA3, 0x180, 0x44, s_esp32c3_efuse},
+};
+// clang-format on
+
+static const struct efuse_layout *efuse_layout(struct ctx *ctx) {
+  size_t i;
+  if (ctx->chip.efuse == 0) return NULL;
+  for (i = 0; i < sizeof(s_efuse_layouts) / sizeof(s_efuse_layouts[0]); i++) {
+    if (s_efuse_layouts[i].id == ctx->chip.id) return &s_efuse_layouts[i];
+  }
+  return NULL;
+}
+
+// Decode MAC address from eFuse words, starting from the MAC registers
+static void efuse_mac(struct ctx *ctx, const uint32_t *w, uint8_t mac[6]) {
+  if (ctx->chip.id == CHIP_ID_ESP8266) {
+    // OTP words 0, 1 and 3 at 0x3ff00050. OUI is either stored in word 3,
+    // or is one of the two Espressif's OUIs selected by word 1
+    uint32_t oui = w[3];
+    if (oui == 0) oui = ((w[1] >> 16) & 255) == 0 ? 0x18fe34 : 0xacd074;
+    mac[0] = (oui >> 16) & 255, mac[1] = (oui >> 8) & 255;
+    mac[2] = oui & 255, mac[3] = (w[1] >> 8) & 255;
+    mac[4] = w[1] & 255, mac[5] = (w[0] >> 24) & 255;
+  } else {
+    mac[0] = (w[1] >> 8) & 255, mac[1] = w[1] & 255;
+    mac[2] = (w[0] >> 24) & 255, mac[3] = (w[0] >> 16) & 255;
+    mac[4] = (w[0] >> 8) & 255, mac[5] = w[0] & 255;
+  }
+}
+
+// Read factory MAC address from eFuse. Return 0 on success
+static int read_mac(struct ctx *ctx, uint8_t mac[6]) {
+  const struct efuse_layout *l = efuse_layout(ctx);
+  uint32_t w[4];
+  size_t n = ctx->chip.id == CHIP_ID_ESP8266 ? 4 : 2;
+  if (l == NULL || read_words(ctx, ctx->chip.efuse + l->mac, w, n) != n)
+    return 1;
+  efuse_mac(ctx, w, mac);
+  return 0;
+}
+
+static uint32_t efuse_get(const uint32_t *w, const struct efuse_field *f) {
+  return (w[f->ofs / 4] >> f->shift) & ((1UL << f->bits) - 1);
+}
+
+// Return chip revision as major * 100 + minor, or -1 if not known
+static int efuse_revision(const uint32_t *w, const struct efuse_field *f) {
+  int major = -1, hi = -1, lo = -1;
+  for (; f->name != NULL; f++) {
+    int v = (int) efuse_get(w, f);
+    if (strcmp(f->name, "wafer_version_major") == 0) major = v;
+    if (strcmp(f->name, "wafer_version_minor_hi") == 0) hi = v;
+    if (strcmp(f->name, "wafer_version_minor_lo") == 0) lo = v;
+  }
+  return major < 0 || hi < 0 || lo < 0 ? -1 : major * 100 + (hi << 3) + lo;
+}
+
+// Print all eFuse words, and decoded fields. With -json, print everything
+// as one JSON object per line, for collecting into inventories
+static void info_full(struct ctx *ctx) {
+  const struct efuse_layout *l = efuse_layout(ctx);
+  const struct efuse_field *f;
+  uint32_t *w, i, n, base = ctx->chip.efuse;
+  uint8_t mac[6];
+  int rev;
+  if (l == NULL) fail("eFuse layout of %s is not known\n", ctx->chip.name);
+  n = l->size / 4;
+  if ((w = malloc(n * sizeof(*w) + 1)) == NULL) fail("malloc failed\n");
+  if (read_words(ctx, base, w, n) != n) fail("Error reading eFuse\n");
+  efuse_mac(ctx, w + l->mac / 4, mac);
+  rev = efuse_revision(w, l->fields);
+  if (ctx->json) {
+    printf("{\"chip_id\":\"0x%x\",\"chip\":\"%s\"", ctx->chip.id,
+           ctx->chip.name);
+    printf(",\"mac\":\"%02x:%02x:%02x:%02x:%02x:%02x\"", mac[0], mac[1],
+           mac[2], mac[3], mac[4], mac[5]);
+    if (rev >= 0) printf(",\"revision\":\"v%d.%d\"", rev / 100, rev % 100);
+    printf(",\"fields\":{");
+    for (f = l->fields; f->name != NULL; f++) {
+      printf("%s\"%s\":%lu", f == l->fields ? "" : ",", f->name,
+             (unsigned long) efuse_get(w, f));
+    }
+    printf("},\"efuse_base\":\"0x%x\",\"efuse\":[", base);
+    for (i = 0; i < n; i++) printf("%s\"0x%08x\"", i ? "," : "", w[i]);
+    printf("]}\n");
+  } else {
+    printf("Chip ID: 0x%x (%s)\n", ctx->chip.id, ctx->chip.name);
+    printf("MAC: %02x:%02x:%02x:%02x:%02x:%02x\n", mac[0], mac[1], mac[2],
+           mac[3], mac[4], mac[5]);
+    if (rev >= 0) printf("Revision: v%d.%d\n", rev / 100, rev % 100);
+    for (f = l->fields; f->name != NULL; f++)
+      printf("%s: %lu\n", f->name, (unsigned long) efuse_get(w, f));
+    for (i = 0; i < n; i++) {
+      if (i % 4 == 0) printf("%s%#x:", i ? "\n" : "", base + i * 4);
+      printf(" %08x", w[i]);
+    }
+    printf("\n");
+  }
+  free(w);
+}
+
 static void info(struct ctx *ctx) {
+  uint8_t mac[6];
   if (!chip_connect(ctx)) fail("Error connecting\n");
+  if (ctx->full || ctx->json) {
+    info_full(ctx);
+    return;
+  }
   printf("Chip ID: 0x%x (%s)\n", ctx->chip.id, ctx->chip.name);
-
-  if (ctx->chip.id == CHIP_ID_ESP32_C3_ECO3) {
-    uint32_t efuse_base = 0x60008800, mac0, mac1;
-    read32(ctx, efuse_base + 0x44, &mac0);
-    read32(ctx, efuse_base + 0x48, &mac1);
-    printf("MAC: %02x:%02x:%02x:%02x:%02x:%02x\n", (mac1 >> 8) & 255,
-           mac1 & 255, (mac0 >> 24) & 255, (mac0 >> 16) & 255,
-           (mac0 >> 8) & 255, mac0 & 255);
+  if (read_mac(ctx, mac) == 0) {
+    printf("MAC: %02x:%02x:%02x:%02x:%02x:%02x\n", mac[0], mac[1], mac[2],
+           mac[3], mac[4], mac[5]);
   }
 }
 
@@ -617,16 +1061,94 @@ static void readmem(struct ctx *ctx, const char **args) {
   } else if (args[0] == NULL || args[1] == NULL) {
     usage(ctx);
   } else {
-    uint32_t i, value, base = strtoul(args[0], NULL, 0),
-                       size = strtoul(args[1], NULL, 0);
-    for (i = 0; i < size; i += 4) {
-      if (read32(ctx, base + i, &value) == 0) {
-        fwrite(&value, 1, sizeof(value), stdout);
-      } else {
-        fprintf(stderr, "Error: mem read @ addr %#x\n", base + i);
+    uint32_t *buf, base = strtoul(args[0], NULL, 0);
+    size_t done, count = (strtoul(args[1], NULL, 0) + 3) / 4;
+    unsigned long t = now_ms();
+    FILE *fp = ctx->out == NULL ? stdout : fopen(ctx->out, "wb");
+    if (fp == NULL) fail("Cannot open %s: %s\n", ctx->out, strerror(errno));
+    if ((buf = malloc(count * 4 + 1)) == NULL) fail("malloc failed\n");
+    done = read_words(ctx, base, buf, count);
+    fwrite(buf, 1, done * 4, fp);
+    if (fp != stdout) fclose(fp);
+    if (done < count) {
+      fprintf(stderr, "Error: mem read @ addr %#x\n",
+              base + (uint32_t) done * 4);
+    } else {
+      report_speed("Read", (uint32_t) done * 4, t);
+    }
+    free(buf);
+  }
+}
+
+// Parse comma-separated list of addresses. Return number of addresses
+static size_t parse_addrs(const char *str, uint32_t **addrs) {
+  size_t n = 1;
+  const char *p;
+  char *end;
+  for (p = str; *p != '\0'; p++) n += *p == ',';
+  *addrs = malloc(n * sizeof(**addrs) + 1);
+  if (*addrs == NULL) fail("malloc failed\n");
+  for (n = 0, p = str;; p = end + 1) {
+    (*addrs)[n++] = strtoul(p, &end, 0);
+    if (end == p || (*end != ',' && *end != '\0'))
+      fail("Invalid address list: %s\n", str);
+    if (*end == '\0') break;
+  }
+  return n;
+}
+
+// Sample a set of registers every -interval milliseconds, until COUNT
+// samples are taken or until interrupted. Every sample is one pipelined burst
+// of READ_REG requests. Records go to stdout or to the -o file, as CSV, or
+// as binary if the file has .bin extension: uint32_t time in milliseconds
+// followed by register values, all little endian
+static void sample(struct ctx *ctx, const char **args) {
+  if (!chip_connect(ctx)) {
+    fail("Error connecting\n");
+  } else if (args[0] == NULL) {
+    usage(ctx);
+  } else {
+    uint32_t *addrs, *rec;
+    size_t i, n = parse_addrs(args[0], &addrs);
+    unsigned long count = args[1] ? strtoul(args[1], NULL, 0) : 0, done = 0;
+    unsigned long missed = 0, t0 = now_ms(), next = t0, t;
+    bool bin = ctx->out != NULL && has_suffix(ctx->out, ".bin");
+    FILE *fp = ctx->out == NULL ? stdout : fopen(ctx->out, bin ? "wb" : "w");
+    if (fp == NULL) fail("Cannot open %s: %s\n", ctx->out, strerror(errno));
+    if ((rec = malloc((n + 1) * sizeof(*rec))) == NULL) fail("malloc failed\n");
+    if (!bin) {
+      fprintf(fp, "ms");
+      for (i = 0; i < n; i++) fprintf(fp, ",%#x", addrs[i]);
+      fprintf(fp, "\n");
+    }
+    for (; s_signo == 0 && (count == 0 || done < count); done++) {
+      rec[0] = (uint32_t) (now_ms() - t0);
+      if (read_words_at(ctx, addrs, rec + 1, n) != n) {
+        if (s_signo == 0) fprintf(stderr, "Error: register read failed\n");
         break;
       }
+      if (bin) {
+        fwrite(rec, sizeof(*rec), n + 1, fp);
+      } else {
+        fprintf(fp, "%u", rec[0]);
+        for (i = 0; i < n; i++) fprintf(fp, ",%#x", rec[i + 1]);
+        fprintf(fp, "\n");
+      }
+      if (fp == stdout) fflush(fp);
+      if (ctx->interval <= 0) continue;
+      next += (unsigned long) ctx->interval, t = now_ms();
+      if (t > next) {
+        missed++, next = t;  // Sampling took too long, skip the deadline
+      } else {
+        sleep_ms((int) (next - t));
+      }
     }
+    t = now_ms() - t0;
+    fprintf(stderr, "%lu samples in %lu ms, %lu samples/s, %lu missed\n",
+            done, t, t == 0 ? 0 : done * 1000 / t, missed);
+    if (fp != stdout) fclose(fp);
+    free(rec);
+    free(addrs);
   }
 }
 
@@ -640,219 +1162,1562 @@ static void spiattach(struct ctx *ctx) {
     d3[0] = a | (b << 6) | (c << 12) | (d << 18) | (e << 24);
     // printf("-----> %u,%u,%u,%u,%u -> %x\n", a, b, c, d, e, pins);
   }
-  if (cmd(ctx, 13, d3, sizeof(d3), 0, 250)) fail("SPI_ATTACH failed\n");
+  // ROM takes an extra zero word, the stub does not
+  if (cmd(ctx, 13, d3, ctx->stub ? 4 : sizeof(d3), 0, 250))
+    fail("SPI_ATTACH failed\n");
   // flash_id, flash size, block_size, sector_size, page_size, status_mask
   if (cmd(ctx, 11, d4, sizeof(d4), 0, 250)) fail("SPI_SET_PARAMS failed\n");
 }
 
-static void readflash(struct ctx *ctx, const char **args) {
-  if (!chip_connect(ctx)) {
-    fail("Error connecting\n");
-  } else if (args[0] == NULL || args[1] == NULL) {
-    usage(ctx);
-  } else if (ctx->chip.id == CHIP_ID_ESP8266) {
-    fail("Can't do it on esp8266\n");
-  } else {
-    uint32_t i = 0, base = strtoul(args[0], NULL, 0),
-             size = strtoul(args[1], NULL, 0);
-    spiattach(ctx);
-    while (i < size) {
-      uint32_t bs = size - i > 64 ? 64 : size - i;
-      uint32_t d[] = {base + i, bs};
-      if (cmd(ctx, 14, d, sizeof(d), 0, 500) != 0) {
-        printf("Error: flash read @ addr %#x\n", base + i);
-        break;
-      } else {
-        fwrite(&ctx->slip.buf[8], 1, bs, stdout);
-        i += bs;
-      }
-    }
-  }
+static unsigned long align_to(unsigned long n, unsigned to) {
+  return ((n + to - 1) / to) * to;
 }
 
-static inline unsigned long hex_to_ul(const char *s, int len) {
-  unsigned long i = 0, v = 0;
-  for (i = 0; i < (unsigned long) len; i++) {
-    int c = s[i];
-    if (i > 0) v <<= 4;
-    v |= (c >= '0' && c <= '9')   ? c - '0'
-         : (c >= 'A' && c <= 'F') ? c - '7'
-                                  : c - 'W';
+struct mem {
+  unsigned char *ptr;
+  int len;
+};
+
+// Contiguous run of data, e.g. loaded from a .hex file or an ELF file
+struct seg {
+  uint32_t addr;  // Flash or memory address
+  size_t len;     // Data length
+  uint8_t *data;  // Data
+};
+
+static void segs_free(struct seg *segs, size_t nsegs) {
+  size_t i;
+  for (i = 0; i < nsegs; i++) free(segs[i].data);
+  free(segs);
+}
+
+static struct mem read_entire_file(const char *path) {
+  struct mem mem;
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) fail("Cannot open %s: %s\n", path, strerror(errno));
+  fseek(fp, 0, SEEK_END);
+  mem.len = ftell(fp);
+  rewind(fp);
+  mem.ptr = malloc(mem.len + 1);  // +1 for the NUL terminator
+  if (mem.ptr == NULL) fail("malloc(%d) failed\n", mem.len);
+  if (fread(mem.ptr, 1, mem.len, fp) != (size_t) mem.len) {
+    fail("fread(%s) failed: %s\n", path, strerror(errno));
   }
-  return v;
+  mem.ptr[mem.len] = '\0';
+  fclose(fp);
+  return mem;
 }
 
-static int rmrf(const char *dirname) {
+// Write file at once. Data goes to a temporary file first, which is then
+// renamed, so readers never see a partially written file. Temporary file
+// name is unique per process, for parallel builds writing the same file
+static void write_entire_file(const char *path, const void *buf, size_t len) {
+  char tmp[1024];
+  FILE *fp;
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
 #ifdef _WIN32
-  char tmp[MAX_PATH], path[MAX_PATH];
-  WIN32_FIND_DATA data;
-  HANDLE hFind;
-  snprintf(tmp, sizeof(tmp), "%s\\*", dirname);
-  hFind = FindFirstFile(tmp, &data);
-  if (hFind != INVALID_HANDLE_VALUE) {
-    do {
-      struct _stat st;
-      snprintf(path, sizeof(path), "%s/%s", dirname, data.cFileName);
-      if (data.cFileName[0] == '.') continue;
-      if (_stat(path, &st) == 0 && (st.st_mode & S_IFDIR)) rmrf(path);
-      remove(path);
-    } while (FindNextFile(hFind, &data));
-    FindClose(hFind);
-  }
-  RemoveDirectory(dirname);
-  return _access(dirname, 0) != 0;
-#else
-  DIR *dp = opendir(dirname);
-  if (dp != NULL) {
-    struct dirent *de;
-    while ((de = readdir(dp)) != NULL) {
-      struct stat st;
-      char path[PATH_MAX];
-      if (de->d_name[0] == '.') continue;
-      snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
-      if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) rmrf(path);
-      remove(path);
-    }
-    closedir(dp);
-  }
-  (void) rmdir(dirname);
-  return access(dirname, 0) != 0;
+  remove(path);  // On Windows, rename() does not replace existing files
 #endif
+  if ((fp = fopen(tmp, "wb")) == NULL || fwrite(buf, 1, len, fp) != len ||
+      fclose(fp) != 0 || rename(tmp, path) != 0)
+    fail("Cannot write %s: %s\n", path, strerror(errno));
 }
 
-// Unpack hex file into a given directory, as a collection of OFFSET.bin files
-// If buf is not null, append all created file names to it.
-static int unhex(const char *hexfile, const char *dir, char *buf, size_t bl) {
-  char tmp[600];
-  int c, n = 0, line = 0;
-  FILE *in = fopen(hexfile, "rb"), *out = NULL;
-  unsigned long upper = 0, next = 0;
-  if (in == NULL) return fail("ERROR: cannot open %s\n", hexfile);
-  if (rmrf(dir) == 0) return fail("Cannot delete dir %s\n", dir);
-  mkdir(dir, 0755);
-  buf[0] = '\0';
-  while ((c = fgetc(in)) != EOF) {
-    if (!isspace(c)) tmp[n++] = c;
-    if (n >= (int) sizeof(tmp) || c == '\n') {
-      int i, len = hex_to_ul(tmp + 1, 2);
-      unsigned long lower = hex_to_ul(tmp + 3, 4);
-      int type = hex_to_ul(tmp + 7, 2);
-      unsigned long addr = upper | lower;
-      if (tmp[0] != ':') return fail("line %d: no colon\n", line);
-      if (n != 1 + 2 + 4 + 2 + len * 2 + 2)
-        return fail("line %d: len %d, expected %d\n", n,
-                    1 + 2 + 4 + 2 + len * 2 + 2);
-      if (type == 0) {
-        if (out == NULL || next != addr) {
-          char path[200];
-          snprintf(path, sizeof(path), "%s/%#lx.bin", dir, addr);
-          if (out != NULL) fclose(out);
-          out = fopen(path, "wb");
-          if (out == NULL) return fail("Cannot open %s", path);
-          // Append created filename to the list of created files
-          snprintf(buf + strlen(buf), bl - strlen(buf), "%s%s",
-                   buf[0] == '\0' ? "" : " ", path);
-        }
-        for (i = 0; i < len; i++) {
-          int byte = hex_to_ul(tmp + 9 + i * 2, 2);
-          fputc(byte, out);
-        }
-        next = addr + len;
-      } else if (type == 1) {
-        if (out != NULL) fclose(out);
-        out = NULL;
-      } else if (type == 4) {
-        upper = hex_to_ul(tmp + 9, 4) << 16;
-      }
-      n = 0;
-    }
+struct Elf32_Ehdr {
+  unsigned char e_ident[16];
+  uint16_t e_type, e_machine;
+  uint32_t e_version, e_entry, e_phoff, e_shoff, e_flags;
+  uint16_t e_ehsize, e_phentsize, e_phnum, e_shentsize, e_shnum, e_shstrndx;
+};
+
+struct Elf32_Phdr {
+  uint32_t p_type, p_offset, p_vaddr, p_paddr;
+  uint32_t p_filesz, p_memsz, p_flags, p_align;
+};
+
+// Make sure that ELF32 file is sane: the program header table and the data
+// of every segment lie within the file
+static void elf_check(const struct mem *elf, const char *path) {
+  struct Elf32_Ehdr e;
+  struct Elf32_Phdr h;
+  size_t i, len = (size_t) elf->len;
+  if (len < sizeof(e) || memcmp(elf->ptr, "\177ELF", 4) != 0 ||
+      elf->ptr[4] != 1)
+    fail("%s: not an ELF32 file\n", path);
+  memcpy(&e, elf->ptr, sizeof(e));
+  if (e.e_phnum == 0 || e.e_phentsize != sizeof(h))
+    fail("%s: unsupported program headers\n", path);
+  if (e.e_phoff > len || e.e_phnum > (len - e.e_phoff) / sizeof(h))
+    fail("%s: program headers out of bounds\n", path);
+  for (i = 0; i < e.e_phnum; i++) {
+    memcpy(&h, elf->ptr + e.e_phoff + i * sizeof(h), sizeof(h));
+    if (h.p_filesz > 0 && (h.p_offset > len || h.p_filesz > len - h.p_offset))
+      fail("%s: segment %d out of bounds\n", path, (int) i);
   }
-  fclose(in);
-  if (out != NULL) fclose(out);
-  return EXIT_SUCCESS;
 }
 
-static int has_suffix(const char *word, const char *suffix) {
-  size_t word_len = strlen(word), suffix_len = strlen(suffix);
-  return word_len > suffix_len &&
-         strcasecmp(&word[word_len - suffix_len], suffix) == 0;
+static struct mem elf_read(const char *path) {
+  struct mem elf = read_entire_file(path);
+  elf_check(&elf, path);
+  return elf;
 }
 
-static void flashbin(struct ctx *ctx, uint16_t flash_params,
-                     uint32_t flash_offset, const char *path) {
-  FILE *fp = fopen(path, "rb");
-  int i, n, size, seq = 0;
-  uint32_t block_size = 4096, hs = 16, encrypted = 0, cs, tmp;
-  uint8_t buf[16 + 4096];  // First 16 bytes are for serial cmd
+static struct Elf32_Phdr elf_phdr_at(const struct mem *elf, int no) {
+  struct Elf32_Ehdr e;
+  struct Elf32_Phdr h;
+  memcpy(&e, elf->ptr, sizeof(e));
+  memcpy(&h, elf->ptr + e.e_phoff + (size_t) no * sizeof(h), sizeof(h));
+  return h;
+}
 
-  if (fp == NULL) fail("Cannot open %s: %s\n", path, strerror(errno));
-  fseek(fp, 0, SEEK_END);
-  size = ftell(fp);
-  rewind(fp);
+static uint32_t elf_get_entry_point(const struct mem *elf) {
+  struct Elf32_Ehdr e;
+  memcpy(&e, elf->ptr, sizeof(e));
+  return e.e_entry;
+}
 
-  memset(buf, 0, hs);  // Clear them
+// Address ranges where flash is mapped into the address space. Code and
+// data placed there is executed from flash, thus cannot be loaded into RAM
+struct xip {
+  uint32_t id;          // Chip ID
+  uint32_t start, end;  // Mapped region
+};
 
-  printf("Erasing %d bytes @ %#x", size, flash_offset);
-  fflush(stdout);
+// clang-format off
+static const struct xip s_xips[] = {
+  {CHIP_ID_ESP8266, 0x40200000, 0x40300000},
+  {CHIP_ID_ESP32, 0x3f400000, 0x3f800000},
+  {CHIP_ID_ESP32, 0x400d0000, 0x40400000},
+  {CHIP_ID_ESP32_S2, 0x3f000000, 0x3ff80000},
+  {CHIP_ID_ESP32_S2, 0x40080000, 0x40b80000},
+  {CHIP_ID_ESP32_C3_ECO_1_2, 0x3c000000, 0x3c800000},
+  {CHIP_ID_ESP32_C3_ECO_1_2, 0x42000000, 0x42800000},
+  {CHIP_ID_ESP32_C3_ECO3, 0x3c000000, 0x3c800000},
+  {CHIP_ID_ESP32_C3_ECO3, 0x42000000, 0x42800000},
+  {CHIP_ID_ESP32_S3_BETA2, 0x3c000000, 0x3e000000},
+  {CHIP_ID_ESP32_S3_BETA2, 0x42000000, 0x44000000},
+  {CHIP_ID_ESP32_S3_BETA3, 0x3c000000, 0x3e000000},
+  {CHIP_ID_ESP32_S3_BETA3, 0x42000000, 0x44000000},
+};
+// clang-format on
 
-  {
-    uint32_t num_blocks = (size + block_size - 1) / block_size;
-    uint32_t d1[] = {size, num_blocks, block_size, flash_offset, encrypted};
-    uint16_t d1size = sizeof(d1) - 4;
-    // Flash begin. S2, S3, C3 chips have an extra 5th parameter.
-    if (ctx->chip.id == CHIP_ID_ESP32_S2 ||
-        ctx->chip.id == CHIP_ID_ESP32_S3_BETA2 ||
-        ctx->chip.id == CHIP_ID_ESP32_S3_BETA3 ||
-        ctx->chip.id == CHIP_ID_ESP32_C6_BETA ||
-        ctx->chip.id == CHIP_ID_ESP32_C3_ECO_1_2 ||
-        ctx->chip.id == CHIP_ID_ESP32_C3_ECO3)
-      d1size += 4;
-    if (cmd(ctx, 2, d1, d1size, 0, 15000)) fail("\nerase failed\n");
-  }
-
-  // Read from file into a buffer, but skip initial 16 bytes
-  while ((n = fread(buf + hs, 1, block_size, fp)) > 0) {
-    int oft = ftell(fp);
-    for (i = 0; i < 100; i++) putchar('\b');
-    printf("Writing %s, %d/%d bytes @ 0x%x (%d%%)", path, n, size,
-           flash_offset + oft - n, oft * 100 / size);
-    fflush(stdout);
+static bool is_flash_mapped(uint32_t chip_id, uint32_t addr) {
+  size_t i;
+  for (i = 0; i < sizeof(s_xips) / sizeof(s_xips[0]); i++) {
+    if (s_xips[i].id == chip_id && addr >= s_xips[i].start &&
+        addr < s_xips[i].end)
+      return true;
+  }
+  return false;
+}
 
-    // Embed flash params into a bootloader image
-    if (seq == 0 && flash_offset == ctx->chip.bla) {
-      if (flash_params != 0) {
-        buf[hs + 2] = (uint8_t) ((flash_params >> 8) & 255);
-        buf[hs + 3] = (uint8_t) (flash_params & 255);
-      }
-      // Set chip type in the extended header at offset 4.
-      // Common header is 8, plus extended header offset 4 = 12
-      if (ctx->chip.id == CHIP_ID_ESP32_C3_ECO3) buf[hs + 12] = 5;
-      if (ctx->chip.id == CHIP_ID_ESP32_C3_ECO_1_2) buf[hs + 12] = 5;
-      if (ctx->chip.id == CHIP_ID_ESP32_S2) {
-        buf[hs + 8] = 0;
-        buf[hs + 12] = 2;
-      }
+// Collect loadable data of an ELF file: PT_LOAD segments that have data in
+// the file. A segment that continues the previous one in the same memory
+// region is merged with it. Return number of segments
+static size_t elf_segments(const struct mem *elf, uint32_t chip_id,
+                           struct seg **segs) {
+  struct Elf32_Ehdr e;
+  size_t i, nsegs = 0;
+  memcpy(&e, elf->ptr, sizeof(e));
+  if ((*segs = calloc(e.e_phnum, sizeof(**segs))) == NULL)
+    fail("malloc failed\n");
+  for (i = 0; i < e.e_phnum; i++) {
+    struct Elf32_Phdr h = elf_phdr_at(elf, (int) i);
+    struct seg *sg = nsegs > 0 ? &(*segs)[nsegs - 1] : NULL;
+    if (h.p_type != 1 || h.p_filesz == 0) continue;  // PT_LOAD only
+    if (sg == NULL || sg->addr + sg->len != h.p_vaddr ||
+        is_flash_mapped(chip_id, sg->addr) !=
+            is_flash_mapped(chip_id, h.p_vaddr)) {
+      sg = &(*segs)[nsegs++];
+      sg->addr = h.p_vaddr;
     }
+    if ((sg->data = realloc(sg->data, sg->len + h.p_filesz)) == NULL)
+      fail("malloc failed\n");
+    memcpy(sg->data + sg->len, elf->ptr + h.p_offset, h.p_filesz);
+    sg->len += h.p_filesz;
+  }
+  return nsegs;
+}
 
-    // Align buffer to block_size and pad with 0xff
-    // memset(buf + hs + n, 255, sizeof(buf) - hs - n);
-    // n = ALIGN(n, block_size);
+struct memdata {
+  const uint8_t *data;  // Segment data
+  uint32_t size, bs;    // Segment size, and block size
+};
 
-    // Flash write
-    tmp = n, memcpy(&buf[0], &tmp, 4);      // Set buffer size
-    tmp = seq++, memcpy(&buf[4], &tmp, 4);  // Set sequence number
-    cs = checksum(buf + hs, n);
-    if (cmd(ctx, 3, buf, (uint16_t) (hs + n), cs, 1500))
-      fail("flash_data failed\n");
-  }
+static uint16_t memdata_req(size_t i, void *buf, void *arg) {
+  struct memdata *m = (struct memdata *) arg;
+  uint32_t ofs = (uint32_t) i * m->bs, n = m->size - ofs, d[4];
+  if (n > m->bs) n = m->bs;
+  d[0] = n, d[1] = (uint32_t) i, d[2] = d[3] = 0;
+  memcpy(buf, d, sizeof(d));
+  memcpy((uint8_t *) buf + sizeof(d), m->data + ofs, n);
+  return (uint16_t) (sizeof(d) + n);
+}
 
-  for (i = 0; i < 100; i++) printf("\b \b");
-  printf("Written %s, %d bytes @ %#x\n", path, size, flash_offset);
-  fclose(fp);
+static void memdata_resp(size_t i, uint8_t *buf, void *arg) {
+  (void) i, (void) buf, (void) arg;
 }
 
-static const char *download(const char *url) {
-  char cmd[2048];
+// Append segment to the image: 8-byte header, followed by data padded to
+// 4 bytes. Data can be NULL for a zero-filled padding segment. If buf is NULL,
+// nothing is written, only the new image offset is calculated
+static size_t image_add(uint8_t *buf, size_t ofs, uint32_t addr,
+                        const uint8_t *data, size_t len) {
+  uint32_t hdr[2];
+  hdr[0] = addr, hdr[1] = (uint32_t) align_to(len, 4);
+  if (buf != NULL) memcpy(buf + ofs, hdr, sizeof(hdr));
+  if (buf != NULL && data != NULL) memcpy(buf + ofs + 8, data, len);
+  return ofs + sizeof(hdr) + hdr[1];
+}
+
+// Convert ELF file into a flashable image
+static struct mem mkimage(struct ctx *ctx, const struct mem *elf,
+                          const char *elf_path) {
+  struct seg *segs;
+  struct mem img;
+  uint8_t common_hdr[] = {0xe9, 1, 0, 0};
+  uint8_t extended_hdr[] = {0xee, 0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  uint8_t cs = 0xef, *buf = NULL;
+  uint32_t entrypoint = elf_get_entry_point(elf);
+  size_t i, ofs = 0, n = 0, size = 0, pass;
+  size_t num_segments = elf_segments(elf, ctx->chip.id, &segs);
+
+  if (ctx->chip.id == CHIP_ID_ESP32_S2) {
+    extended_hdr[0] = 0x00;
+    extended_hdr[4] = 2;
+  }
+  if (ctx->chip.id == CHIP_ID_ESP32_C3_ECO_1_2 ||
+      ctx->chip.id == CHIP_ID_ESP32_C3_ECO3) {
+    extended_hdr[4] = 5;
+  }
+  if (ctx->xip && (ctx->chip.id == 0 || ctx->chip.id == CHIP_ID_ESP8266))
+    fail("-xip requires -chip, and is not supported on ESP8266\n");
+
+  // First pass calculates image layout and size, second pass writes it.
+  // With -xip, data of a flash-mapped segment is placed at the same offset
+  // within a 64KB page as its address, so the bootloader can map it via MMU
+  // rather than copy. The gap before it is filled by a padding segment
+  for (pass = 0; pass < 2; pass++) {
+    ofs = sizeof(common_hdr) + sizeof(entrypoint) + sizeof(extended_hdr);
+    for (i = n = 0; i < num_segments; i++) {
+      if (ctx->xip && is_flash_mapped(ctx->chip.id, segs[i].addr)) {
+        size_t pad = (segs[i].addr - (ofs + 8)) & 0xffff;
+        if (segs[i].addr & 3)
+          fail("%s: flash-mapped segment @ %#x is not 4-byte aligned\n",
+               elf_path, segs[i].addr);
+        if (pad > 0 && pad < 8) pad += 0x10000;  // Make room for a header
+        if (pad > 0) ofs = image_add(buf, ofs, 0, NULL, pad - 8), n++;
+        if (pass > 0 && ctx->verbose) printf("  padding %u\n", (unsigned) pad);
+      }
+      if (pass > 0 && ctx->verbose)
+        printf("  addr %x size %u\n", segs[i].addr,
+               (unsigned) align_to(segs[i].len, 4));
+      if (pass > 0) cs = checksum2(cs, segs[i].data, segs[i].len);
+      ofs = image_add(buf, ofs, segs[i].addr, segs[i].data, segs[i].len), n++;
+    }
+    if (pass > 0) break;
+    if (n == 0 || n > 16)
+      fail("%s: %d segments, expecting 1..16\n", elf_path, (int) n);
+    size = align_to(ofs + 1, 16);
+    if ((buf = calloc(1, size)) == NULL) fail("malloc failed\n");
+    if (ctx->verbose) printf("%s: %d segments found\n", elf_path, (int) n);
+  }
+
+  common_hdr[1] = (uint8_t) n;
+  memcpy(buf, common_hdr, sizeof(common_hdr));         // Common header
+  memcpy(buf + 4, &entrypoint, sizeof(entrypoint));    // Entry point
+  memcpy(buf + 8, extended_hdr, sizeof(extended_hdr));  // Extended header
+  buf[size - 1] = cs;  // Checksum is the last byte of 16-byte aligned image
+
+  segs_free(segs, num_segments);
+  img.ptr = buf, img.len = (int) size;
+  return img;
+}
+
+// Load ELF file into RAM and run it. Loadable segments are written with
+// MEM_BEGIN / MEM_DATA, then MEM_END jumps to the entry point.
+// Return entry point
+static uint32_t ram_run(struct ctx *ctx, const char *path) {
+  struct mem elf = elf_read(path);
+  struct Elf32_Ehdr e;
+  struct seg *segs;
+  struct memdata m;
+  uint32_t d[4];
+  size_t i, count, nsegs = elf_segments(&elf, ctx->chip.id, &segs);
+
+  memcpy(&e, elf.ptr, sizeof(e));
+  for (i = 0; i < nsegs; i++) {
+    if (is_flash_mapped(ctx->chip.id, segs[i].addr))
+      fail("%s: segment @ %#x is mapped to flash, cannot run from RAM\n",
+           path, segs[i].addr);
+    m.data = segs[i].data, m.size = (uint32_t) segs[i].len, m.bs = 0x1800;
+    count = (m.size + m.bs - 1) / m.bs;
+    d[0] = m.size, d[1] = (uint32_t) count, d[2] = m.bs, d[3] = segs[i].addr;
+    if (cmd(ctx, 5, d, sizeof(d), 0, 1000)) fail("MEM_BEGIN failed\n");
+    // ROM copies a block and responds quickly, so let the next block
+    // travel over the wire while the previous one is being processed
+    if (cmd_pipeline(ctx, 7, count, 2, 1000, memdata_req, memdata_resp, &m) !=
+        count)
+      fail("MEM_DATA failed\n");
+    if (ctx->verbose) printf("Loaded %u bytes @ %#x\n", m.size, segs[i].addr);
+  }
+
+  d[0] = 0, d[1] = e.e_entry;  // Do not stay in the loader, jump to entry
+  cmd_send(ctx, 6, d, 8, 0);
+  segs_free(segs, nsegs);
+  free(elf.ptr);
+  return e.e_entry;
+}
+
+// Upload flasher stub into RAM and run it. Running stub greets with "OHAI",
+// and from then on it speaks the stub flavour of the protocol: 2-byte
+// status, raw MD5, streamed READ_FLASH
+static void stub_start(struct ctx *ctx) {
+  uint32_t entry;
+  size_t len;
+  if (ctx->stubfile == NULL || ctx->stub) return;
+  entry = ram_run(ctx, ctx->stubfile);
+  while ((len = frame_recv(ctx, 3000)) > 0) {
+    if (len == 4 && memcmp(ctx->slip.buf, "OHAI", 4) == 0) break;
+  }
+  if (len == 0) fail("%s: stub did not start\n", ctx->stubfile);
+  ctx->stub = true;
+  if (ctx->verbose) printf("Stub started, entry point %#x\n", entry);
+}
+
+// Load firmware into RAM, run it, and show its output like monitor does
+static void run(struct ctx *ctx, const char **args) {
+  uint32_t entry;
+  if (args[0] == NULL) usage(ctx);
+  if (!chip_connect(ctx)) fail("Error connecting\n");
+  entry = ram_run(ctx, args[0]);
+  printf("Running %s, entry point %#x\n", args[0], entry);
+  fflush(stdout);
+  while (s_signo == 0) monitor(ctx);
+}
+
+// Prepare for the flash operations: start the stub if requested, and
+// switch to the requested baud rate
+static void flasher_start(struct ctx *ctx) {
+  stub_start(ctx);
+  if (atoi(ctx->baud) > 115200) {
+    // ROM ignores the second parameter, stub expects the current baud rate
+    uint32_t data[] = {(uint32_t) atoi(ctx->baud), ctx->stub ? 115200 : 0};
+    if (cmd(ctx, 15, data, sizeof(data), 0, 50)) fail("SET_BAUD failed\n");
+    change_baud(ctx->fd, atoi(ctx->baud), ctx->verbose);
+  }
+}
+
+static inline unsigned long hex_to_ul(const char *s, int len) {
+  unsigned long i = 0, v = 0;
+  for (i = 0; i < (unsigned long) len; i++) {
+    int c = s[i];
+    if (i > 0) v <<= 4;
+    v |= (c >= '0' && c <= '9')   ? c - '0'
+         : (c >= 'A' && c <= 'F') ? c - '7'
+                                  : c - 'W';
+  }
+  return v;
+}
+
+// Extract digest from the SPI_FLASH_MD5 response. ROM returns 32 hex chars,
+// stub returns 16 raw bytes
+static void md5_from_response(struct ctx *ctx, const uint8_t *buf,
+                              uint8_t digest[16]) {
+  int i;
+  if (ctx->stub) {
+    memcpy(digest, &buf[8], 16);
+  } else {
+    for (i = 0; i < 16; i++) {
+      digest[i] = (uint8_t) hex_to_ul((const char *) &buf[8 + i * 2], 2);
+    }
+  }
+}
+
+// ESP8266 ROM has no SPI_FLASH_MD5, the stub has it
+static bool has_md5(struct ctx *ctx) {
+  return ctx->chip.id != CHIP_ID_ESP8266 || ctx->stub;
+}
+
+// Intel HEX lookup tables: hex digit values, -1 for non-hex characters,
+// and two lowercase hex digits for every byte value
+static signed char s_hexval[256];
+static char s_hexbyte[256][2];
+
+static void hex_init(void) {
+  int i;
+  for (i = 0; i < 256; i++) {
+    s_hexval[i] = -1;
+    s_hexbyte[i][0] = "0123456789abcdef"[i >> 4];
+    s_hexbyte[i][1] = "0123456789abcdef"[i & 15];
+  }
+  for (i = 0; i < 10; i++) s_hexval['0' + i] = (signed char) i;
+  for (i = 0; i < 6; i++) {
+    s_hexval['a' + i] = s_hexval['A' + i] = (signed char) (10 + i);
+  }
+}
+
+// Write one Intel HEX record. The line is assembled in memory first
+static void hexrecord(FILE *fp, int type, uint32_t addr, const uint8_t *p,
+                      size_t n) {
+  char line[1 + 2 * (4 + 255 + 1) + 1], *s = line;
+  uint8_t hdr[4];
+  unsigned cs = 0;
+  size_t i;
+  if (s_hexval[0] == 0) hex_init();
+  hdr[0] = (uint8_t) n, hdr[1] = (uint8_t) (addr >> 8);
+  hdr[2] = (uint8_t) addr, hdr[3] = (uint8_t) type;
+  *s++ = ':';
+  for (i = 0; i < 4; i++) cs += hdr[i], memcpy(s, s_hexbyte[hdr[i]], 2), s += 2;
+  for (i = 0; i < n; i++) cs += p[i], memcpy(s, s_hexbyte[p[i]], 2), s += 2;
+  memcpy(s, s_hexbyte[(~cs + 1) & 255], 2), s += 2;
+  *s++ = '\n';
+  fwrite(line, 1, (size_t) (s - line), fp);
+}
+
+// Write data as Intel HEX records of up to recsize bytes. Records never cross
+// a 64KB boundary, and an extended linear address record is written whenever
+// the upper 16 address bits change
+static void writehex(FILE *fp, uint32_t addr, const uint8_t *p, size_t len,
+                     size_t recsize, uint32_t *upper) {
+  while (len > 0) {
+    size_t n = len < recsize ? len : recsize;
+    if (n > 0x10000 - (addr & 0xffff)) n = 0x10000 - (addr & 0xffff);
+    if ((addr >> 16) != *upper) {
+      uint8_t hi[2];
+      *upper = addr >> 16;
+      hi[0] = (uint8_t) (*upper >> 8), hi[1] = (uint8_t) *upper;
+      hexrecord(fp, 4, 0, hi, sizeof(hi));
+    }
+    hexrecord(fp, 0, addr & 0xffff, p, n);
+    addr += (uint32_t) n, p += n, len -= n;
+  }
+}
+
+// Ask ROM to calculate MD5 of a flash region. Return 0 on success
+static int flash_md5(struct ctx *ctx, uint32_t addr, uint32_t size,
+                     uint8_t digest[16]) {
+  uint32_t d[] = {addr, size, 0, 0};
+  int timeout_ms = 3000 + (int) (size / 1024) * 8;  // 8 seconds per megabyte
+  if (!has_md5(ctx)) return 1;
+  if (cmd(ctx, 19, d, sizeof(d), 0, timeout_ms) != 0) return 1;
+  md5_from_response(ctx, ctx->slip.buf, digest);
+  return 0;
+}
+
+// Compare flash region with host data using ROM SPI_FLASH_MD5 command.
+// Return 0 if they match, 1 if they don't, -1 if MD5 is not available
+static int flash_cmp(struct ctx *ctx, uint32_t addr, const uint8_t *data,
+                     size_t size) {
+  uint8_t d1[16], d2[16];
+  if (flash_md5(ctx, addr, (uint32_t) size, d1) != 0) return -1;
+  md5(data, size, d2);
+  return memcmp(d1, d2, sizeof(d1)) == 0 ? 0 : 1;
+}
+
+static void verify_region(struct ctx *ctx, uint32_t addr, const uint8_t *data,
+                          size_t size, const char *name) {
+  int res = flash_cmp(ctx, addr, data, size);
+  if (res < 0) fail("Cannot verify %s: MD5 is not supported\n", name);
+  if (res > 0) fail("Verify failed: %s @ %#x\n", name, addr);
+  printf("Verified %s, %d bytes @ %#x\n", name, (int) size, addr);
+}
+
+enum { BLANK_CHECK_SIZE = 65536 };  // -sparse checks blocks of that size
+
+struct rdflash {
+  uint32_t base, size;  // Flash region to read
+  uint32_t first;       // First 64-byte chunk to read
+  FILE *fp;             // Output stream
+  uint8_t *buf;         // Output buffer, used instead of fp if set
+  uint8_t *map;         // Bitmap of fetched chunks, when reading into a file
+  char *mapfile;        // Bitmap file name
+  uint8_t *blank;       // Flags of blank blocks, for -sparse
+  uint8_t chunk[64];    // Chunk being assembled from READ_REG words
+  bool unverified;      // Stub read in progress, do not mark chunks yet
+};
+
+// ESP8266 ROM has no READ_FLASH_SLOW, but ESP8266 maps the first megabyte
+// of flash at this address, so flash can be read with READ_REG
+#define ESP8266_FLASH_MAP 0x40200000
+#define ESP8266_FLASH_MAP_SIZE 0x100000
+
+static uint16_t rdflash_req(size_t i, void *buf, void *arg) {
+  struct rdflash *r = (struct rdflash *) arg;
+  uint32_t ofs = (r->first + (uint32_t) i) * 64, d[2];
+  d[0] = r->base + ofs;                            // Address
+  d[1] = r->size - ofs > 64 ? 64 : r->size - ofs;  // Size
+  memcpy(buf, d, sizeof(d));
+  return sizeof(d);
+}
+
+static void rdflash_save_map(struct rdflash *r) {
+  uint32_t hdr[] = {r->base, r->size};
+  FILE *fp = fopen(r->mapfile, "wb");
+  if (fp == NULL) fail("Cannot open %s: %s\n", r->mapfile, strerror(errno));
+  fflush(r->fp);  // Chunks marked as fetched must be in the file
+  fwrite(hdr, 1, sizeof(hdr), fp);
+  fwrite(r->map, 1, (r->size + 511) / 512, fp);  // 1 bit per 64 bytes
+  fclose(fp);
+}
+
+// Mark chunk as fetched in the map
+static void rdflash_mark(struct rdflash *r, uint32_t chunk) {
+  r->map[chunk / 8] |= (uint8_t) (1 << (chunk % 8));
+  if (chunk % 1024 == 1023) rdflash_save_map(r);  // Save every 64KB
+}
+
+static void rdflash_store(struct rdflash *r, uint32_t chunk,
+                          const uint8_t *data) {
+  uint32_t ofs = chunk * 64, n = r->size - ofs > 64 ? 64 : r->size - ofs;
+  if (r->buf != NULL) {
+    memcpy(r->buf + ofs, data, n);
+    return;
+  }
+  if (r->map != NULL) fseek(r->fp, (long) ofs, SEEK_SET);
+  fwrite(data, 1, n, r->fp);
+  if (r->map != NULL && !r->unverified) rdflash_mark(r, chunk);
+}
+
+static void rdflash_resp(size_t i, uint8_t *buf, void *arg) {
+  struct rdflash *r = (struct rdflash *) arg;
+  rdflash_store(r, r->first + (uint32_t) i, &buf[8]);
+}
+
+// Mapped flash reads: request i reads i-th 32-bit word, starting from the
+// first chunk. Words are assembled into chunks, so the rest of the dump
+// code works with 64-byte chunks regardless of the chip
+static uint16_t rdflash_mapped_req(size_t i, void *buf, void *arg) {
+  struct rdflash *r = (struct rdflash *) arg;
+  uint32_t addr = ESP8266_FLASH_MAP + r->base + r->first * 64;
+  addr += (uint32_t) i * 4;
+  memcpy(buf, &addr, sizeof(addr));
+  return sizeof(addr);
+}
+
+static void rdflash_mapped_resp(size_t i, uint8_t *buf, void *arg) {
+  struct rdflash *r = (struct rdflash *) arg;
+  uint32_t chunk = r->first + (uint32_t) i / 16, ofs = (uint32_t) i % 16 * 4;
+  memcpy(r->chunk + ofs, &buf[4], 4);
+  if (ofs == 60 || chunk * 64 + ofs + 4 >= r->size)
+    rdflash_store(r, chunk, r->chunk);
+}
+
+// Stub's READ_FLASH streams data in blocks, and expects every block to be
+// acknowledged with the total number of bytes received. MD5 of the whole
+// region follows the data. Return number of chunks fetched
+static uint32_t rdflash_stub(struct ctx *ctx, struct rdflash *r,
+                             uint32_t first, uint32_t count) {
+  uint32_t got = 0, n = r->size - first * 64, d[4];
+  uint8_t digest[16];
+  struct md5 m;
+  size_t j, len;
+  if (n > count * 64) n = count * 64;
+  d[0] = r->base + first * 64, d[1] = n, d[2] = 4096, d[3] = 64;
+  if (cmd(ctx, 0xd2, d, sizeof(d), 0, 500) != 0) return 0;
+  r->unverified = true;  // Chunks go into the map only when MD5 matches
+  md5_init(&m);
+  while (got < n) {
+    len = frame_recv(ctx, 3000);
+    if (len == 0 || got + len > n || (len % 64 != 0 && got + len < n)) break;
+    md5_update(&m, ctx->slip.buf, len);
+    for (j = 0; j < len; j += 64) {
+      rdflash_store(r, first + (got + (uint32_t) j) / 64, ctx->slip.buf + j);
+    }
+    got += (uint32_t) len;
+    slip_send(&got, sizeof(got), uart_tx, &ctx->fd);  // Acknowledge
+  }
+  md5_final(&m, digest);
+  r->unverified = false;
+  if (got == n && frame_recv(ctx, 3000) == 16 &&
+      memcmp(ctx->slip.buf, digest, 16) == 0) {
+    for (j = 0; r->map != NULL && j < n; j += 64) {
+      rdflash_mark(r, first + (uint32_t) j / 64);
+    }
+    return count;
+  }
+  cmd_drain(ctx);
+  return 0;
+}
+
+// Fetch `count` 64-byte chunks starting from the `first` chunk.
+// Return number of chunks fetched
+static uint32_t rdflash_fetch(struct ctx *ctx, struct rdflash *r,
+                              uint32_t first, uint32_t count) {
+  uint32_t n, words;
+  size_t done;
+  r->first = first;
+  if (ctx->stub) return rdflash_stub(ctx, r, first, count);
+  if (ctx->chip.id != CHIP_ID_ESP8266) {
+    // ROM UART FIFO is 128 bytes, and a READ_FLASH_SLOW request is 18 bytes
+    // when framed. 4 requests in flight fit comfortably
+    return (uint32_t) cmd_pipeline(ctx, 14, count, 4, 500, rdflash_req,
+                                   rdflash_resp, r);
+  }
+  n = r->size - first * 64 > count * 64 ? count * 64 : r->size - first * 64;
+  words = (n + 3) / 4;
+  // READ_REG request takes up to 18 bytes framed, keep 6 in flight
+  done = cmd_pipeline(ctx, 10, words, 6, 100, rdflash_mapped_req,
+                      rdflash_mapped_resp, r);
+  return done == words ? count : (uint32_t) done / 16;
+}
+
+struct md5blocks {
+  struct ctx *ctx;          // Context, for decoding responses
+  uint32_t base, size, bs;  // Flash region, and block size
+  uint8_t (*digests)[16];   // MD5 of every block
+};
+
+static uint16_t md5blocks_req(size_t i, void *buf, void *arg) {
+  struct md5blocks *m = (struct md5blocks *) arg;
+  uint32_t ofs = (uint32_t) i * m->bs, d[4] = {0, 0, 0, 0};
+  d[0] = m->base + ofs;
+  d[1] = m->size - ofs > m->bs ? m->bs : m->size - ofs;
+  memcpy(buf, d, sizeof(d));
+  return sizeof(d);
+}
+
+static void md5blocks_resp(size_t i, uint8_t *buf, void *arg) {
+  struct md5blocks *m = (struct md5blocks *) arg;
+  md5_from_response(m->ctx, buf, m->digests[i]);
+}
+
+// Calculate on-device MD5 of every `bs`-sized block of a flash region.
+// Requests are pipelined. Return 0 on success
+static int flash_md5_blocks(struct ctx *ctx, uint32_t base, uint32_t size,
+                            uint32_t bs, uint8_t (*digests)[16]) {
+  struct md5blocks m;
+  size_t count = (size + bs - 1) / bs;
+  int timeout_ms = 3000 + (int) (bs / 1024) * 8;
+  m.ctx = ctx, m.base = base, m.size = size, m.bs = bs, m.digests = digests;
+  if (!has_md5(ctx)) return 1;
+  return cmd_pipeline(ctx, 19, count, 4, timeout_ms, md5blocks_req,
+                      md5blocks_resp, &m) == count
+             ? 0
+             : 1;
+}
+
+// Calculate MD5 of `len` bytes of 0xFF, i.e. of an erased flash region
+static void md5_ff(size_t len, uint8_t digest[16]) {
+  uint8_t ff[64];
+  struct md5 m;
+  memset(ff, 0xff, sizeof(ff));
+  md5_init(&m);
+  for (; len > sizeof(ff); len -= sizeof(ff)) md5_update(&m, ff, sizeof(ff));
+  md5_update(&m, ff, len);
+  md5_final(&m, digest);
+}
+
+// Find blank blocks, i.e. blocks filled with 0xFF, by comparing their
+// on-device MD5 with the MD5 of 0xFF block
+static void find_blank_blocks(struct ctx *ctx, struct rdflash *r) {
+  size_t i, nblank = 0, nblocks = (r->size + BLANK_CHECK_SIZE - 1) /
+                                  BLANK_CHECK_SIZE;
+  uint8_t(*d)[16] = malloc(nblocks * 16 + 1), ff[2][16];
+  r->blank = calloc(1, nblocks + 1);
+  if (d == NULL || r->blank == NULL) fail("malloc failed\n");
+  if (flash_md5_blocks(ctx, r->base, r->size, BLANK_CHECK_SIZE, d) != 0)
+    fail("Error: blank check failed\n");
+  md5_ff(BLANK_CHECK_SIZE, ff[0]);            // Full block
+  md5_ff(r->size % BLANK_CHECK_SIZE, ff[1]);  // Last partial block
+  for (i = 0; i < nblocks; i++) {
+    bool last = (i + 1) * BLANK_CHECK_SIZE > r->size;
+    r->blank[i] = memcmp(d[i], ff[last ? 1 : 0], 16) == 0;
+    nblank += r->blank[i];
+  }
+  free(d);
+  fprintf(stderr, "%u of %u blocks are blank\n", (unsigned) nblank,
+          (unsigned) nblocks);
+}
+
+// Read flash region into a buffer. Return 0 on success
+static int read_flash(struct ctx *ctx, uint32_t addr, uint8_t *buf,
+                      uint32_t size) {
+  struct rdflash r;
+  size_t count = (size + 63) / 64;
+  memset(&r, 0, sizeof(r));
+  r.base = addr, r.size = size, r.buf = buf;
+  return rdflash_fetch(ctx, &r, 0, (uint32_t) count) == count ? 0 : 1;
+}
+
+// Read flash region into a file, keeping a bitmap of fetched 64-byte chunks
+// in the FILE.map. If the dump is interrupted, -resume fetches only chunks
+// that are missing. Return number of bytes fetched
+static uint32_t readflash_to_file(struct ctx *ctx, struct rdflash *r) {
+  uint32_t i, j, hdr[2], nchunks = (r->size + 63) / 64, fetched = 0;
+  size_t done, mapsize = (nchunks + 7) / 8;
+  uint8_t ff[64];
+  FILE *fp;
+
+  r->mapfile = malloc(strlen(ctx->out) + 5);
+  r->map = calloc(1, mapsize + 1);
+  if (r->mapfile == NULL || r->map == NULL) fail("malloc failed\n");
+  sprintf(r->mapfile, "%s.map", ctx->out);
+  if (ctx->resume && (fp = fopen(r->mapfile, "rb")) != NULL) {
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) || hdr[0] != r->base ||
+        hdr[1] != r->size || fread(r->map, 1, mapsize, fp) != mapsize)
+      fail("%s: not a map for %#x %u\n", r->mapfile, r->base, r->size);
+    fclose(fp);
+    r->fp = fopen(ctx->out, "r+b");
+  }
+  if (r->fp == NULL) {
+    memset(r->map, 0, mapsize);
+    r->fp = fopen(ctx->out, "w+b");
+  }
+  if (r->fp == NULL) fail("Cannot open %s: %s\n", ctx->out, strerror(errno));
+
+  // Preallocate output file
+  fseek(r->fp, 0, SEEK_END);
+  if (r->size > 0 && ftell(r->fp) < (long) r->size) {
+    fseek(r->fp, (long) r->size - 1, SEEK_SET);
+    fputc(0, r->fp);
+  }
+
+  // Blank blocks are not fetched, fill them with 0xFF locally
+  memset(ff, 0xff, sizeof(ff));
+  for (i = 0; r->blank != NULL && i < nchunks; i++) {
+    if (!r->blank[i * 64 / BLANK_CHECK_SIZE]) continue;
+    fseek(r->fp, (long) i * 64, SEEK_SET);
+    fwrite(ff, 1, r->size - i * 64 > 64 ? 64 : r->size - i * 64, r->fp);
+    r->map[i / 8] |= (uint8_t) (1 << (i % 8));
+  }
+
+  // Fetch every run of missing chunks
+  for (i = 0; i < nchunks; i = j) {
+    while (i < nchunks && (r->map[i / 8] & (1 << (i % 8)))) i++;
+    j = i;
+    while (j < nchunks && !(r->map[j / 8] & (1 << (j % 8)))) j++;
+    if (i >= j) break;
+    done = rdflash_fetch(ctx, r, i, j - i);
+    fetched += (uint32_t) done * 64;
+    if (done < j - i) {
+      rdflash_save_map(r);
+      fail("Error: flash read @ addr %#x. Use -resume to continue\n",
+           r->base + (i + (uint32_t) done) * 64);
+    }
+  }
+  fclose(r->fp);
+  remove(r->mapfile);  // Dump is complete, map is not needed anymore
+  free(r->mapfile);
+  free(r->map);
+  return fetched > r->size ? r->size : fetched;
+}
+
+// Read flash region in blocks. Blank blocks are not fetched, but filled
+// with 0xFF locally. Data goes either to r->buf, or to r->fp.
+// Return number of bytes fetched
+static uint32_t readflash_blocks(struct ctx *ctx, struct rdflash *r) {
+  uint32_t i, j, n, count, fetched = 0;
+  for (i = 0; i < r->size; i += n) {
+    n = r->size - i > BLANK_CHECK_SIZE ? BLANK_CHECK_SIZE : r->size - i;
+    if (r->blank != NULL && r->blank[i / BLANK_CHECK_SIZE]) {
+      if (r->buf != NULL) {
+        memset(r->buf + i, 0xff, n);
+      } else {
+        for (j = 0; j < n; j++) fputc(0xff, r->fp);
+      }
+      continue;
+    }
+    count = (n + 63) / 64;
+    if (rdflash_fetch(ctx, r, i / 64, count) < count) {
+      fflush(r->fp);
+      fail("Error: flash read @ addr %#x\n", r->base + i);
+    }
+    fetched += n;
+  }
+  return fetched;
+}
+
+// Write non-blank blocks as Intel HEX
+static void writehex_blocks(struct rdflash *r, FILE *fp, size_t recsize) {
+  uint32_t i, n, upper = ~0U;
+  for (i = 0; i < r->size; i += n) {
+    n = r->size - i > BLANK_CHECK_SIZE ? BLANK_CHECK_SIZE : r->size - i;
+    if (!r->blank[i / BLANK_CHECK_SIZE])
+      writehex(fp, r->base + i, r->buf + i, n, recsize, &upper);
+  }
+  hexrecord(fp, 1, 0, NULL, 0);
+}
+
+enum { PT_SIZE = 0xc00 };  // Max size of the partition table
+
+struct subtype {
+  uint8_t type, subtype;  // Partition type and subtype
+  const char *name;       // Subtype name
+};
+
+// clang-format off
+static const struct subtype s_subtypes[] = {
+  {0, 0x00, "factory"}, {0, 0x20, "test"}, {1, 0x00, "ota"}, {1, 0x01, "phy"},
+  {1, 0x02, "nvs"}, {1, 0x03, "coredump"}, {1, 0x04, "nvs_keys"},
+  {1, 0x05, "efuse"}, {1, 0x81, "fat"}, {1, 0x82, "spiffs"},
+  {1, 0x83, "littlefs"},
+};
+// clang-format on
+
+// Parse binary partition table: 32-byte entries, followed by an optional
+// MD5 entry, followed by 0xff padding
+static void pt_parse(struct ctx *ctx, const uint8_t *buf, size_t len,
+                     const char *src) {
+  size_t ofs;
+  uint8_t digest[16];
+  free(ctx->parts);
+  ctx->parts = calloc(len / 32 + 1, sizeof(*ctx->parts));
+  if (ctx->parts == NULL) fail("malloc failed\n");
+  ctx->nparts = 0;
+  for (ofs = 0; ofs + 32 <= len; ofs += 32) {
+    const uint8_t *p = buf + ofs;
+    struct part *part = &ctx->parts[ctx->nparts];
+    if (p[0] == 0xeb && p[1] == 0xeb) {
+      md5(buf, ofs, digest);
+      if (memcmp(digest, p + 16, 16) != 0)
+        fail("%s: partition table MD5 mismatch\n", src);
+      continue;
+    }
+    if (p[0] != 0xaa || p[1] != 0x50) break;
+    part->type = p[2], part->subtype = p[3];
+    memcpy(&part->offset, p + 4, 4);
+    memcpy(&part->size, p + 8, 4);
+    memcpy(part->label, p + 12, 16);
+    ctx->nparts++;
+  }
+  if (ctx->nparts == 0) fail("%s: no partition table\n", src);
+  if (ctx->verbose) {
+    for (ofs = 0; ofs < ctx->nparts; ofs++) {
+      struct part *part = &ctx->parts[ofs];
+      printf("  %-16s %2u %#4x %#8x %#8x\n", part->label, part->type,
+             part->subtype, part->offset, part->size);
+    }
+  }
+}
+
+// Per-user cache directory: %LOCALAPPDATA%/esputil, $XDG_CACHE_HOME/esputil
+// or ~/.cache/esputil, created if missing. Return 0 if there is none
+static int cache_dir(char *buf, size_t len) {
+  const char *dir = getenv("LOCALAPPDATA"), *home = getenv("HOME");
+  if (dir == NULL) dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL) {
+    snprintf(buf, len, "%s/esputil", dir);
+  } else if (home != NULL) {
+    snprintf(buf, len, "%s/.cache", home);
+    mkdir(buf, 0700);
+    snprintf(buf + strlen(buf), len - strlen(buf), "/esputil");
+  } else {
+    return 0;
+  }
+  return mkdir(buf, 0700) == 0 || errno == EEXIST;
+}
+
+// Load partition table from the -pt file, or from the device flash, 0x8000
+// by default. Device table is cached per device MAC in the user's cache dir.
+// Cached table is used if its MD5 matches the on-device MD5
+static void pt_load(struct ctx *ctx) {
+  const char *src = ctx->pt == NULL ? "0x8000" : ctx->pt;
+  uint8_t buf[PT_SIZE], mac[6], d1[16], d2[16];
+  char dir[1024], path[1100];
+  uint32_t addr;
+  FILE *fp;
+  int cache;
+
+  if (!isdigit((unsigned char) src[0])) {
+    struct mem mem;
+    if (ctx->parts != NULL) return;
+    mem = read_entire_file(src);
+    pt_parse(ctx, mem.ptr, (size_t) mem.len, src);
+    free(mem.ptr);
+    return;
+  }
+
+  if (ctx->parts != NULL && ctx->imgbuf == NULL) return;
+  addr = strtoul(src, NULL, 0);
+  if (ctx->imgbuf != NULL) {
+    // Composing flash image: the table is whatever has been written so far
+    if (addr > ctx->imgsize || sizeof(buf) > ctx->imgsize - addr)
+      fail("Partition table @ %#x is outside of %s\n", addr, ctx->img);
+    pt_parse(ctx, ctx->imgbuf + addr, sizeof(buf), ctx->img);
+    return;
+  }
+  memset(mac, 0, sizeof(mac));
+  read_mac(ctx, mac);
+  cache = cache_dir(dir, sizeof(dir));
+  snprintf(path, sizeof(path), "%s/%02x%02x%02x%02x%02x%02x-%x.pt", dir,
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], addr);
+  if (cache && (fp = fopen(path, "rb")) != NULL) {
+    size_t n = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    md5(buf, sizeof(buf), d1);
+    if (n == sizeof(buf) && flash_md5(ctx, addr, sizeof(buf), d2) == 0 &&
+        memcmp(d1, d2, sizeof(d1)) == 0) {
+      pt_parse(ctx, buf, sizeof(buf), path);
+      return;
+    }
+  }
+  if (read_flash(ctx, addr, buf, sizeof(buf)) != 0)
+    fail("Error reading partition table @ %#x\n", addr);
+  pt_parse(ctx, buf, sizeof(buf), src);
+  if (cache) write_entire_file(path, buf, sizeof(buf));
+}
+
+// Find partition by label, or by TYPE:SUBTYPE, e.g. "app:factory"
+static const struct part *pt_find(struct ctx *ctx, const char *name) {
+  const char *colon = strchr(name, ':');
+  size_t i;
+  int type = -1, subtype = -1;
+  unsigned n;
+  pt_load(ctx);
+  for (i = 0; i < ctx->nparts; i++) {
+    if (strcmp(ctx->parts[i].label, name) == 0) return &ctx->parts[i];
+  }
+  if (colon == NULL) return NULL;
+  if (strncmp(name, "app:", 4) == 0) type = 0;
+  if (strncmp(name, "data:", 5) == 0) type = 1;
+  for (i = 0; i < sizeof(s_subtypes) / sizeof(s_subtypes[0]); i++) {
+    const struct subtype *st = &s_subtypes[i];
+    if (st->type == type && strcmp(st->name, colon + 1) == 0)
+      subtype = st->subtype;
+  }
+  if (type == 0 && sscanf(colon + 1, "ota_%u", &n) == 1 && n < 16)
+    subtype = 0x10 + (int) n;
+  for (i = 0; i < ctx->nparts; i++) {
+    if (ctx->parts[i].type == type && ctx->parts[i].subtype == subtype)
+      return &ctx->parts[i];
+  }
+  return NULL;
+}
+
+// Parse flash address, given either as a number or as a partition name.
+// For a partition, store partition size into `size`
+static uint32_t flash_addr(struct ctx *ctx, const char *str, uint32_t *size) {
+  const struct part *part;
+  if (isdigit((unsigned char) str[0])) return strtoul(str, NULL, 0);
+  if ((part = pt_find(ctx, str)) == NULL) fail("Unknown partition: %s\n", str);
+  if (size != NULL) *size = part->size;
+  return part->offset;
+}
+
+// If the partition table is in use, refuse writes that cross partition
+// boundaries: a write must fit into one partition, or not touch any
+static void pt_check(struct ctx *ctx, uint32_t addr, size_t size,
+                     const char *name) {
+  size_t i;
+  uint32_t end = addr + (uint32_t) size;
+  if (ctx->pt == NULL && ctx->parts == NULL) return;
+  if (ctx->imgbuf != NULL && ctx->parts == NULL &&
+      isdigit((unsigned char) ctx->pt[0])) {
+    // Composing flash image: nothing to check until the table is written
+    uint32_t pt = strtoul(ctx->pt, NULL, 0);
+    if (pt + 2 > ctx->imgsize || ctx->imgbuf[pt] != 0xaa ||
+        ctx->imgbuf[pt + 1] != 0x50)
+      return;
+  }
+  pt_load(ctx);
+  for (i = 0; i < ctx->nparts; i++) {
+    const struct part *p = &ctx->parts[i];
+    if (addr >= p->offset && addr < p->offset + p->size) {
+      if (end > p->offset + p->size)
+        fail("%s (%u bytes @ %#x) does not fit into partition %s\n", name,
+             (unsigned) size, addr, p->label);
+      return;
+    }
+  }
+  for (i = 0; i < ctx->nparts; i++) {
+    const struct part *p = &ctx->parts[i];
+    if (addr < p->offset + p->size && end > p->offset)
+      fail("%s (%u bytes @ %#x) overlaps partition %s\n", name,
+           (unsigned) size, addr, p->label);
+  }
+}
+
+static void readflash(struct ctx *ctx, const char **args) {
+  if (ctx->verify && ctx->out == NULL) {
+    fail("-verify needs -o FILE, the dump on stdout cannot be verified\n");
+  } else if (!chip_connect(ctx)) {
+    fail("Error connecting\n");
+  } else if (args[0] == NULL) {
+    usage(ctx);
+  } else {
+    struct rdflash r;
+    unsigned long t = now_ms();
+    uint32_t fetched;
+    memset(&r, 0, sizeof(r));
+    flasher_start(ctx);
+    if (ctx->chip.id != CHIP_ID_ESP8266 || ctx->stub) spiattach(ctx);
+    r.base = flash_addr(ctx, args[0], &r.size);
+    if (args[1] != NULL) r.size = strtoul(args[1], NULL, 0);
+    if (r.size == 0) usage(ctx);
+    if (ctx->chip.id == CHIP_ID_ESP8266 && !ctx->stub) {
+      if (r.base % 4 != 0) fail("ESP8266: address must be 4-byte aligned\n");
+      if (r.base + r.size > ESP8266_FLASH_MAP_SIZE || r.base + r.size < r.base)
+        fail("ESP8266: can read only the first %uKB\n",
+             ESP8266_FLASH_MAP_SIZE / 1024);
+      if (ctx->sparse) fail("ESP8266: -sparse is not supported\n");
+    }
+    if (ctx->sparse) find_blank_blocks(ctx, &r);
+    if (ctx->out != NULL && has_suffix(ctx->out, ".hex")) {
+      // Intel HEX output contains only non-blank blocks
+      FILE *fp = fopen(ctx->out, "w");
+      if (fp == NULL) fail("Cannot open %s: %s\n", ctx->out, strerror(errno));
+      if ((r.buf = malloc(r.size + 1)) == NULL) fail("malloc failed\n");
+      if (r.blank == NULL) r.blank = calloc(1, r.size / BLANK_CHECK_SIZE + 1);
+      fetched = readflash_blocks(ctx, &r);
+      writehex_blocks(&r, fp, (size_t) ctx->recsize);
+      fclose(fp);
+    } else if (ctx->out != NULL) {
+      fetched = readflash_to_file(ctx, &r);
+    } else {
+      r.fp = stdout;
+      fetched = readflash_blocks(ctx, &r);
+      fflush(stdout);
+    }
+    report_speed("Read", fetched, t);
+    if (ctx->verify) {
+      if (r.buf != NULL) {
+        verify_region(ctx, r.base, r.buf, r.size, ctx->out);
+      } else {
+        struct mem mem = read_entire_file(ctx->out);
+        verify_region(ctx, r.base, mem.ptr, mem.len, ctx->out);
+        free(mem.ptr);
+      }
+    }
+    free(r.buf);
+    free(r.blank);
+  }
+}
+
+static int rmrf(const char *dirname) {
+#ifdef _WIN32
+  char tmp[MAX_PATH], path[MAX_PATH];
+  WIN32_FIND_DATA data;
+  HANDLE hFind;
+  snprintf(tmp, sizeof(tmp), "%s\\*", dirname);
+  hFind = FindFirstFile(tmp, &data);
+  if (hFind != INVALID_HANDLE_VALUE) {
+    do {
+      struct _stat st;
+      snprintf(path, sizeof(path), "%s/%s", dirname, data.cFileName);
+      if (data.cFileName[0] == '.') continue;
+      if (_stat(path, &st) == 0 && (st.st_mode & S_IFDIR)) rmrf(path);
+      remove(path);
+    } while (FindNextFile(hFind, &data));
+    FindClose(hFind);
+  }
+  RemoveDirectory(dirname);
+  return _access(dirname, 0) != 0;
+#else
+  DIR *dp = opendir(dirname);
+  if (dp != NULL) {
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+      struct stat st;
+      char path[PATH_MAX];
+      if (de->d_name[0] == '.') continue;
+      snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
+      if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) rmrf(path);
+      remove(path);
+    }
+    closedir(dp);
+  }
+  (void) rmdir(dirname);
+  return access(dirname, 0) != 0;
+#endif
+}
+
+// Append data to the segment list. Data contiguous with the last segment
+// extends it, otherwise a new segment is started
+static void segs_add(struct seg **segs, size_t *nsegs, size_t *cap,
+                     uint32_t addr, const uint8_t *data, size_t len) {
+  struct seg *sg = *nsegs > 0 ? &(*segs)[*nsegs - 1] : NULL;
+  if (sg == NULL || sg->addr + sg->len != addr) {
+    if ((*nsegs & (*nsegs + 1)) == 0 || *nsegs == 0) {  // 0, 1, 3, 7, ...
+      *segs = realloc(*segs, (*nsegs * 2 + 1) * sizeof(**segs));
+      if (*segs == NULL) fail("malloc failed\n");
+    }
+    sg = &(*segs)[(*nsegs)++];
+    sg->addr = addr, sg->len = 0, sg->data = NULL, *cap = 0;
+  }
+  if (sg->len + len > *cap) {
+    *cap = (sg->len + len) * 2;
+    if ((sg->data = realloc(sg->data, *cap)) == NULL) fail("malloc failed\n");
+  }
+  memcpy(sg->data + sg->len, data, len);
+  sg->len += len;
+}
+
+// Load hex file into memory, as a list of contiguous segments.
+// Every record is checked for length and checksum. Return number of segments
+static size_t hex_load(const char *hexfile, struct seg **segs) {
+  struct mem mem = read_entire_file(hexfile);
+  const unsigned char *p = mem.ptr, *end = mem.ptr + mem.len;
+  uint8_t rec[1 + 2 + 1 + 255 + 1];  // len, addr, type, data, checksum
+  unsigned long upper = 0;
+  size_t nsegs = 0, cap = 0;
+  int line = 1;
+  if (s_hexval[0] == 0) hex_init();
+  *segs = NULL;
+  for (;;) {
+    size_t i, n;
+    unsigned sum = 0;
+    while (p < end && isspace(*p)) line += (*p++ == '\n');
+    if (p >= end) break;
+    if (*p++ != ':') fail("%s:%d: no colon\n", hexfile, line);
+    for (i = n = 0; i < n + 5; i++, p += 2) {
+      int hi = p + 1 < end ? s_hexval[p[0]] : -1;
+      int lo = p + 1 < end ? s_hexval[p[1]] : -1;
+      if ((hi | lo) < 0) {
+        if (p + 1 >= end || isspace(p[0]) || isspace(p[1]))
+          fail("%s:%d: record shorter than %d bytes\n", hexfile, line,
+               (int) n + 5);
+        fail("%s:%d: bad hex digit\n", hexfile, line);
+      }
+      rec[i] = (uint8_t) (hi << 4 | lo);
+      sum += rec[i];
+      if (i == 0) n = rec[0];
+    }
+    if (p < end && !isspace(*p))
+      fail("%s:%d: record longer than %d bytes\n", hexfile, line,
+           (int) n + 5);
+    if (sum & 255) fail("%s:%d: checksum mismatch\n", hexfile, line);
+    if (rec[3] == 0) {
+      unsigned long addr = upper + ((unsigned long) rec[1] << 8 | rec[2]);
+      segs_add(segs, &nsegs, &cap, (uint32_t) addr, rec + 4, n);
+    } else if (rec[3] == 1) {
+      break;
+    } else if ((rec[3] == 2 || rec[3] == 4) && n == 2) {
+      upper = (unsigned long) rec[4] << 8 | rec[5];
+      upper <<= rec[3] == 2 ? 4 : 16;
+    } else if ((rec[3] == 3 || rec[3] == 5) && n == 4) {
+      // Start address records: no flash data, ignore
+    } else if (rec[3] <= 5) {
+      fail("%s:%d: bad length %d for record type %d\n", hexfile, line,
+           (int) n, rec[3]);
+    } else {
+      fail("%s:%d: bad record type %d\n", hexfile, line, rec[3]);
+    }
+  }
+  free(mem.ptr);
+  return nsegs;
+}
+
+// Save segments into a given directory, as a collection of OFFSET.bin files
+static int segs_save(struct seg *segs, size_t nsegs, const char *dir) {
+  size_t i;
+  if (rmrf(dir) == 0) return fail("Cannot delete dir %s\n", dir);
+  mkdir(dir, 0755);
+  for (i = 0; i < nsegs; i++) {
+    char path[1024];
+    FILE *out;
+    snprintf(path, sizeof(path), "%s/%#lx.bin", dir,
+             (unsigned long) segs[i].addr);
+    if ((out = fopen(path, "wb")) == NULL) fail("Cannot open %s\n", path);
+    fwrite(segs[i].data, 1, segs[i].len, out);
+    fclose(out);
+  }
+  segs_free(segs, nsegs);
+  return EXIT_SUCCESS;
+}
+
+// Firmware bundle file: a header, followed by a segment table, followed by
+// segment data. Data of each segment starts at a 4KB-aligned file offset.
+// All numbers are little-endian
+#define BUNDLE_MAGIC "ESPB"
+#define BUNDLE_ALIGN 4096
+
+struct bundle_hdr {
+  char magic[4];     // BUNDLE_MAGIC
+  uint32_t version;  // Format version, 1
+  uint32_t nsegs;    // Number of entries in the segment table
+  uint32_t flags;    // Reserved, must be 0
+};
+
+struct bundle_seg {
+  uint32_t addr;    // Flash address
+  uint32_t len;     // Data length
+  uint32_t offset;  // Data offset in the bundle file
+  uint32_t flags;   // Reserved, must be 0
+  uint8_t md5[16];  // MD5 of the data
+};
+
+// Load bundle file into a list of segments. The whole bundle, including
+// every segment digest, is checked before anything is returned
+static size_t bundle_load(const char *path, struct seg **segs) {
+  struct mem mem = read_entire_file(path);
+  struct bundle_hdr hdr;
+  size_t i, size = (size_t) mem.len;
+  if (size < sizeof(hdr)) fail("%s: not a bundle\n", path);
+  memcpy(&hdr, mem.ptr, sizeof(hdr));
+  if (memcmp(hdr.magic, BUNDLE_MAGIC, sizeof(hdr.magic)) != 0)
+    fail("%s: not a bundle\n", path);
+  if (hdr.version != 1 || hdr.flags != 0)
+    fail("%s: unsupported bundle version %lu, flags %#lx\n", path,
+         (unsigned long) hdr.version, (unsigned long) hdr.flags);
+  if (hdr.nsegs > (size - sizeof(hdr)) / sizeof(struct bundle_seg))
+    fail("%s: truncated segment table\n", path);
+  if ((*segs = calloc(hdr.nsegs + 1, sizeof(**segs))) == NULL)
+    fail("malloc failed\n");
+  for (i = 0; i < hdr.nsegs; i++) {
+    struct bundle_seg bs;
+    uint8_t digest[16];
+    memcpy(&bs, mem.ptr + sizeof(hdr) + i * sizeof(bs), sizeof(bs));
+    if (bs.flags != 0)
+      fail("%s: segment %d: unsupported flags %#lx\n", path, (int) i,
+           (unsigned long) bs.flags);
+    if (bs.offset > size || bs.len > size - bs.offset)
+      fail("%s: segment %d: data out of bounds\n", path, (int) i);
+    md5(mem.ptr + bs.offset, bs.len, digest);
+    if (memcmp(digest, bs.md5, sizeof(digest)) != 0)
+      fail("%s: segment %d @ %#lx: MD5 mismatch\n", path, (int) i,
+           (unsigned long) bs.addr);
+    (*segs)[i].addr = bs.addr, (*segs)[i].len = bs.len;
+    if (((*segs)[i].data = malloc(bs.len + 1)) == NULL) fail("malloc failed\n");
+    memcpy((*segs)[i].data, mem.ptr + bs.offset, bs.len);
+  }
+  free(mem.ptr);
+  return hdr.nsegs;
+}
+
+// Pack binary files into a bundle file
+static int mkbundle(const char *path, const char **args) {
+  struct bundle_hdr hdr;
+  struct bundle_seg *table;
+  struct mem *files;
+  uint8_t *buf;
+  size_t i, n = 0, size;
+  FILE *fp;
+  while (args[n * 2] && args[n * 2 + 1]) n++;
+  table = calloc(n + 1, sizeof(*table));
+  files = calloc(n + 1, sizeof(*files));
+  if (table == NULL || files == NULL) fail("malloc failed\n");
+  size = sizeof(hdr) + n * sizeof(*table);
+  for (i = 0; i < n; i++) {
+    files[i] = read_entire_file(args[i * 2 + 1]);
+    size = (size + BUNDLE_ALIGN - 1) / BUNDLE_ALIGN * BUNDLE_ALIGN;
+    table[i].addr = (uint32_t) strtoul(args[i * 2], NULL, 0);
+    table[i].len = (uint32_t) files[i].len;
+    table[i].offset = (uint32_t) size;
+    md5(files[i].ptr, (size_t) files[i].len, table[i].md5);
+    size += (size_t) files[i].len;
+  }
+  memcpy(hdr.magic, BUNDLE_MAGIC, sizeof(hdr.magic));
+  hdr.version = 1, hdr.nsegs = (uint32_t) n, hdr.flags = 0;
+  // Assemble the whole bundle in memory, and write it at once
+  if ((buf = calloc(1, size + 1)) == NULL) fail("malloc failed\n");
+  memcpy(buf, &hdr, sizeof(hdr));
+  memcpy(buf + sizeof(hdr), table, n * sizeof(*table));
+  for (i = 0; i < n; i++) {
+    memcpy(buf + table[i].offset, files[i].ptr, table[i].len);
+    free(files[i].ptr);
+  }
+  if ((fp = fopen(path, "wb")) == NULL)
+    fail("Cannot open %s: %s\n", path, strerror(errno));
+  if (fwrite(buf, 1, size, fp) != size)
+    fail("Cannot write %s: %s\n", path, strerror(errno));
+  fclose(fp);
+  free(buf), free(files), free(table);
+  return EXIT_SUCCESS;
+}
+
+// Embed flash params into a bootloader image
+static void patch_image(struct ctx *ctx, uint16_t flash_params,
+                        uint32_t flash_offset, uint8_t *data, size_t size) {
+  if (flash_offset != ctx->chip.bla || size < 16) return;
+  if (flash_params != 0) {
+    data[2] = (uint8_t) ((flash_params >> 8) & 255);
+    data[3] = (uint8_t) (flash_params & 255);
+  }
+  // Set chip type in the extended header at offset 4.
+  // Common header is 8, plus extended header offset 4 = 12
+  if (ctx->chip.id == CHIP_ID_ESP32_C3_ECO3) data[12] = 5;
+  if (ctx->chip.id == CHIP_ID_ESP32_C3_ECO_1_2) data[12] = 5;
+  if (ctx->chip.id == CHIP_ID_ESP32_S2) {
+    data[8] = 0;
+    data[12] = 2;
+  }
+}
+
+// Return the size of ESP-IDF image with appended SHA-256, or 0 if `data`
+// is not such an image. The header is followed by segments, then padding
+// with a checksum byte to 16 bytes, then a 32-byte SHA-256 digest
+static size_t image_len(const uint8_t *data, size_t size) {
+  size_t i, ofs = 24;  // Common header 8, plus extended header 16
+  uint32_t len;
+  if (size < ofs || data[0] != 0xe9 || data[23] != 1) return 0;
+  for (i = 0; i < data[1]; i++) {
+    if (ofs + 8 > size) return 0;
+    memcpy(&len, &data[ofs + 4], sizeof(len));  // Segment header: ADDR SIZE
+    if (len > size - ofs - 8) return 0;
+    ofs += 8 + len;
+  }
+  ofs = align_to(ofs + 1, 16) + 32;
+  return ofs <= size ? ofs : 0;
+}
+
+// Return true if the device already has the same image at a given address.
+// Compare just image headers and SHA-256 digests, that takes two reads.
+// ESP8266 images have no extended header and no digest, so never match
+static bool image_unchanged(struct ctx *ctx, uint32_t addr,
+                            const uint8_t *data, size_t size) {
+  size_t len = image_len(data, size);
+  uint8_t hdr[24], digest[32];
+  if (len == 0 || ctx->chip.id == CHIP_ID_ESP8266) return false;
+  return read_flash(ctx, addr, hdr, sizeof(hdr)) == 0 &&
+         memcmp(hdr, data, sizeof(hdr)) == 0 &&
+         read_flash(ctx, addr + (uint32_t) len - 32, digest, 32) == 0 &&
+         memcmp(digest, data + len - 32, 32) == 0;
+}
+
+// Flash erases at about 30 seconds per megabyte in the worst case
+static int erase_timeout_ms(uint32_t size) {
+  int ms = (int) (size / 1024) * 30;
+  return ms < 15000 ? 15000 : ms;
+}
+
+// ESP8266 ROM erases the 4KB sectors up to the next 64KB block one by one,
+// and then erases more than asked: in total, twice the head sectors, or as
+// many extra sectors as head sectors. Return the erase size to pass to ROM,
+// so that exactly the requested sectors get erased, like esptool does
+static uint32_t esp8266_erase_size(uint32_t offset, uint32_t size) {
+  uint32_t num_sectors = (size + 4095) / 4096;
+  uint32_t head_sectors = 16 - (offset / 4096) % 16;
+  if (num_sectors < head_sectors) head_sectors = num_sectors;
+  if (num_sectors < 2 * head_sectors) return (num_sectors + 1) / 2 * 4096;
+  return (num_sectors - head_sectors) * 4096;
+}
+
+// Send FLASH_BEGIN. ROM erases the region straight away, stub erases it
+// lazily while writing. Return 0 on success
+static int flash_begin(struct ctx *ctx, uint32_t size, uint32_t block_size,
+                       uint32_t flash_offset) {
+  uint32_t num_blocks = (size + block_size - 1) / block_size, encrypted = 0;
+  uint32_t d[] = {size, num_blocks, block_size, flash_offset, encrypted};
+  uint16_t dsize = sizeof(d) - 4;
+  if (!ctx->stub && ctx->chip.id == CHIP_ID_ESP8266)
+    d[0] = esp8266_erase_size(flash_offset, size);
+  // S2, S3, C3 ROMs have an extra 5th parameter, stub does not
+  if (!ctx->stub && (ctx->chip.id == CHIP_ID_ESP32_S2 ||
+                     ctx->chip.id == CHIP_ID_ESP32_S3_BETA2 ||
+                     ctx->chip.id == CHIP_ID_ESP32_S3_BETA3 ||
+                     ctx->chip.id == CHIP_ID_ESP32_C6_BETA ||
+                     ctx->chip.id == CHIP_ID_ESP32_C3_ECO_1_2 ||
+                     ctx->chip.id == CHIP_ID_ESP32_C3_ECO3))
+    dsize += 4;
+  return cmd(ctx, 2, d, dsize, 0, erase_timeout_ms(size));
+}
+
+static void flashmem(struct ctx *ctx, uint32_t flash_offset, uint8_t *data,
+                     size_t size, const char *name) {
+  size_t i, n, ofs;
+  uint32_t seq = 0, block_size = ctx->stub ? 16384 : 4096, hs = 16, cs, tmp;
+  uint8_t buf[16 + 16384];  // First 16 bytes are for serial cmd
+
+  // When composing flash image, just copy data into it
+  if (ctx->imgbuf != NULL) {
+    if (flash_offset > ctx->imgsize || size > ctx->imgsize - flash_offset)
+      fail("%s (%d bytes @ %#x) does not fit into %s\n", name, (int) size,
+           flash_offset, ctx->img);
+    memcpy(ctx->imgbuf + flash_offset, data, size);
+    printf("Written %s, %d bytes @ %#x\n", name, (int) size, flash_offset);
+    return;
+  }
+
+  // Skip images that are already on the device. When flashing a per-device
+  // overlay, shared base images are compared by MD5. With -ifchanged,
+  // ESP-IDF images are compared by headers and appended SHA-256 digests
+  if ((ctx->ovl != NULL && flash_cmp(ctx, flash_offset, data, size) == 0) ||
+      (ctx->ifchanged && image_unchanged(ctx, flash_offset, data, size))) {
+    printf("Unchanged %s, %d bytes @ %#x\n", name, (int) size, flash_offset);
+    return;
+  }
+
+  memset(buf, 0, hs);  // Clear them
+
+  printf("Erasing %d bytes @ %#x", (int) size, flash_offset);
+  fflush(stdout);
+
+  if (flash_begin(ctx, (uint32_t) size, block_size, flash_offset))
+    fail("\nerase failed\n");
+
+  // Copy data into a buffer, but skip initial 16 bytes
+  for (ofs = 0; ofs < size; ofs += n) {
+    n = size - ofs > block_size ? block_size : size - ofs;
+    memcpy(buf + hs, data + ofs, n);
+    for (i = 0; i < 100; i++) putchar('\b');
+    printf("Writing %s, %d/%d bytes @ 0x%x (%d%%)", name, (int) n, (int) size,
+           flash_offset + (uint32_t) ofs, (int) ((ofs + n) * 100 / size));
+    fflush(stdout);
+
+    // Flash write
+    tmp = n, memcpy(&buf[0], &tmp, 4);      // Set buffer size
+    tmp = seq++, memcpy(&buf[4], &tmp, 4);  // Set sequence number
+    cs = checksum(buf + hs, n);
+    if (cmd(ctx, 3, buf, (uint16_t) (hs + n), cs, ctx->stub ? 3000 : 1500))
+      fail("flash_data failed\n");
+  }
+
+  for (i = 0; i < 100; i++) printf("\b \b");
+  printf("Written %s, %d bytes @ %#x\n", name, (int) size, flash_offset);
+  if (ctx->verify) verify_region(ctx, flash_offset, data, size, name);
+}
+
+// Erase flash region. ROM has no erase command, but FLASH_BEGIN erases the
+// region. Stub has ERASE_REGION
+static void erase_region(struct ctx *ctx, uint32_t addr, uint32_t size) {
+  uint32_t d[] = {addr, size};
+  int res;
+  printf("Erasing %u bytes @ %#x\n", size, addr);
+  fflush(stdout);
+  if (ctx->stub) {
+    res = cmd(ctx, 0xd1, d, sizeof(d), 0, erase_timeout_ms(size));
+  } else {
+    res = flash_begin(ctx, size, 4096, addr);
+  }
+  if (res != 0) fail("Error: erase @ %#x failed\n", addr);
+}
+
+// Erase flash region, skipping blocks that are already blank. Blocks are
+// checked by on-device MD5, and consecutive non-blank blocks are erased
+// together. With "all", erase the whole chip, which requires the stub
+static void erase(struct ctx *ctx, const char **args) {
+  uint32_t i, j, n, nblocks, nerased = 0;
+  unsigned long t = now_ms();
+  struct rdflash r;
+
+  if (args[0] == NULL) usage(ctx);
+  if (!chip_connect(ctx)) fail("Error connecting\n");
+  flasher_start(ctx);
+  if (ctx->chip.id != CHIP_ID_ESP8266) spiattach(ctx);
+  if (strcmp(args[0], "all") == 0) {
+    if (!ctx->stub) fail("Erasing the whole chip requires -stub\n");
+    printf("Erasing the whole chip\n");
+    if (cmd(ctx, 0xd0, NULL, 0, 0, 120000)) fail("Error: erase failed\n");
+    printf("Erased in %lu ms\n", now_ms() - t);
+    return;
+  }
+
+  memset(&r, 0, sizeof(r));
+  r.base = flash_addr(ctx, args[0], &r.size);
+  if (args[1] != NULL) r.size = strtoul(args[1], NULL, 0);
+  if (r.size == 0) usage(ctx);
+  if (r.base % 4096 != 0 || r.size % 4096 != 0)
+    fail("Address and size must be 4096-byte aligned\n");
+  nblocks = (r.size + BLANK_CHECK_SIZE - 1) / BLANK_CHECK_SIZE;
+  if (has_md5(ctx)) find_blank_blocks(ctx, &r);
+
+  // Erase every run of non-blank blocks with one command
+  for (i = 0; i < nblocks; i = j) {
+    while (i < nblocks && r.blank != NULL && r.blank[i]) i++;
+    j = i;
+    while (j < nblocks && (r.blank == NULL || !r.blank[j])) j++;
+    if (i >= j) break;
+    n = j * BLANK_CHECK_SIZE > r.size ? r.size - i * BLANK_CHECK_SIZE
+                                      : (j - i) * BLANK_CHECK_SIZE;
+    erase_region(ctx, r.base + i * BLANK_CHECK_SIZE, n);
+    nerased += j - i;
+  }
+  printf("Erased %u of %u blocks in %lu ms\n", nerased, nblocks,
+         now_ms() - t);
+  free(r.blank);
+}
+
+// Patch per-device overlay into a base image that fully contains it,
+// so that erasing the base image sectors does not wipe the overlay
+static void overlay_patch(struct ctx *ctx, uint32_t addr, uint8_t *buf,
+                          size_t len) {
+  if (ctx->ovlbuf == NULL || ctx->ovladdr < addr ||
+      ctx->ovladdr - addr > len || ctx->ovllen > len - (ctx->ovladdr - addr))
+    return;
+  memcpy(buf + (ctx->ovladdr - addr), ctx->ovlbuf, ctx->ovllen);
+  ctx->ovlpatched = true;
+}
+
+static void flashbuf(struct ctx *ctx, uint16_t flash_params,
+                     uint32_t flash_offset, uint8_t *buf, size_t len,
+                     const char *name) {
+  pt_check(ctx, flash_offset, len, name);
+  overlay_patch(ctx, flash_offset, buf, len);
+  patch_image(ctx, flash_params, flash_offset, buf, len);
+  flashmem(ctx, flash_offset, buf, len, name);
+}
+
+// Read image file to be placed at a given flash address. An ELF file is
+// converted into an image in memory, for the connected chip
+static struct mem read_image(struct ctx *ctx, const char *path,
+                             uint32_t addr) {
+  struct mem mem = read_entire_file(path), img;
+  if (mem.len < 4 || memcmp(mem.ptr, "\177ELF", 4) != 0) return mem;
+  if (ctx->chip.id == CHIP_ID_ESP8266)
+    fail("%s: ESP8266 images cannot be made from ELF, use .bin\n", path);
+  if (ctx->xip && addr % 0x10000 != 0)
+    fail("%s: with -xip, address %#x must be 64KB-aligned\n", path, addr);
+  elf_check(&mem, path);
+  img = mkimage(ctx, &mem, path);
+  free(mem.ptr);
+  return img;
+}
+
+static void flashbin(struct ctx *ctx, uint16_t flash_params,
+                     uint32_t flash_offset, const char *path) {
+  struct mem mem = read_image(ctx, path, flash_offset);
+  flashbuf(ctx, flash_params, flash_offset, mem.ptr, (size_t) mem.len, path);
+  free(mem.ptr);
+}
+
+// Load per-device overlay, given as "ADDR,FILE". A .csv overlay file is
+// a list of "MAC,HEXDATA" lines, and the line for the device MAC is used.
+// Any other file is used as is
+static struct mem load_overlay(struct ctx *ctx, uint32_t *addr) {
+  char want[20], *path = NULL, *p, *eol;
+  uint8_t mac[6];
+  struct mem mem;
+  int len = 0;
+  *addr = strtoul(ctx->ovl, &path, 0);
+  if (*path++ != ',') fail("Invalid overlay %s, want ADDR,FILE\n", ctx->ovl);
+  mem = read_entire_file(path);
+  if (!has_suffix(path, ".csv")) return mem;
+  if (read_mac(ctx, mac) != 0) fail("Cannot read MAC address\n");
+  snprintf(want, sizeof(want), "%02x:%02x:%02x:%02x:%02x:%02x,", mac[0],
+           mac[1], mac[2], mac[3], mac[4], mac[5]);
+  for (p = (char *) mem.ptr; *p != '\0'; p = eol + 1) {
+    if ((eol = strchr(p, '\n')) == NULL) eol = p + strlen(p) - 1;
+    while (isspace((unsigned char) *p)) p++;
+    if (strncasecmp(p, want, strlen(want)) != 0) continue;
+    for (p += strlen(want); isspace((unsigned char) *p);) p++;
+    for (; isxdigit((unsigned char) p[0]) && isxdigit((unsigned char) p[1]);
+         p += 2) {
+      mem.ptr[len++] = (unsigned char) hex_to_ul(p, 2);
+    }
+    if (len == 0) fail("%s: empty data for %s\n", path, want);
+    mem.len = len;
+    return mem;
+  }
+  fail("%s: no entry for %s\n", path, want);
+  return mem;
+}
+
+// Write per-device overlay on top of the base images, and verify it.
+// Flash is erased in 4KB sectors, so unless the overlay was patched into
+// a base image, the sectors it touches are read from the device, merged
+// with the overlay, and written back whole
+static void flash_overlay(struct ctx *ctx) {
+  uint32_t start = ctx->ovladdr / 4096 * 4096;
+  uint32_t end = (uint32_t) align_to(ctx->ovladdr + ctx->ovllen, 4096);
+  uint8_t *buf;
+  if (ctx->ovlpatched) {
+    if (!ctx->verify && has_md5(ctx))
+      verify_region(ctx, ctx->ovladdr, ctx->ovlbuf, ctx->ovllen, "overlay");
+    return;
+  }
+  if ((buf = malloc(end - start)) == NULL) fail("malloc failed\n");
+  if (read_flash(ctx, start, buf, end - start) != 0)
+    fail("Error: flash read @ addr %#x\n", start);
+  memcpy(buf + (ctx->ovladdr - start), ctx->ovlbuf, ctx->ovllen);
+  flashmem(ctx, start, buf, end - start, "overlay");
+  if (!ctx->verify && has_md5(ctx))
+    verify_region(ctx, start, buf, end - start, "overlay");
+  free(buf);
+}
+
+static const char *download(const char *url) {
+  char cmd[2048];
   const char *slash = strrchr(url, '/');
   if (slash == NULL) fail("Invalid URL: %s\n", url);
   snprintf(cmd, sizeof(cmd), "curl -sL %s -o %s", url, slash + 1);
@@ -861,15 +2726,12 @@ static const char *download(const char *url) {
   return slash + 1;
 }
 
-static void flash(struct ctx *ctx, const char **args) {
+// Attach SPI flash and return flash params: either set by the user,
+// or taken from the existing bootloader
+static uint16_t flash_attach(struct ctx *ctx) {
   uint16_t flash_params = 0;
-  if (!chip_connect(ctx)) fail("Error connecting\n");
   if (ctx->fpar != NULL) flash_params = (uint16_t) strtoul(ctx->fpar, NULL, 0);
-  if (atoi(ctx->baud) > 115200) {
-    uint32_t data[] = {atoi(ctx->baud), 0};
-    if (cmd(ctx, 15, data, sizeof(data), 0, 50)) fail("SET_BAUD failed\n");
-    change_baud(ctx->fd, atoi(ctx->baud), ctx->verbose);
-  }
+  flasher_start(ctx);
 
   // For non-ESP8266, SPI attach is mandatory
   if (ctx->chip.id != CHIP_ID_ESP8266) {
@@ -878,50 +2740,79 @@ static void flash(struct ctx *ctx, const char **args) {
     // Load first word from the bootloader - flash params are encoded there,
     // in the last 2 bytes, see README.md in the repo root
     if (ctx->fpar == NULL) {
-      uint32_t d5[] = {ctx->chip.bla, 16};
-      if (cmd(ctx, 14, d5, sizeof(d5), 0, 2000) != 0) {
+      uint8_t hdr[16];
+      if (read_flash(ctx, ctx->chip.bla, hdr, sizeof(hdr)) != 0) {
         printf("Error: can't read bootloader @ addr %#x\n", ctx->chip.bla);
-      } else if (ctx->slip.buf[8] != 0xe9) {
+      } else if (hdr[0] != 0xe9) {
         printf("Wrong magic for bootloader @ addr %#x\n", ctx->chip.bla);
       } else {
-        flash_params = (ctx->slip.buf[10] << 8) | ctx->slip.buf[11];
+        flash_params = (uint16_t) ((hdr[2] << 8) | hdr[3]);
       }
     }
   }
   printf("Using flash params %#hx\n", flash_params);
+  return flash_params;
+}
+
+static void flash(struct ctx *ctx, const char **args) {
+  uint16_t flash_params = 0;
+  if (ctx->img != NULL) {
+    // Compose flash image file instead of flashing a device
+    if (ctx->chip.id == 0) fail("-img requires -chip\n");
+    if (ctx->ovl != NULL) fail("-ov is not supported with -img\n");
+    if ((ctx->imgbuf = malloc(ctx->imgsize)) == NULL) fail("malloc failed\n");
+    memset(ctx->imgbuf, 0xff, ctx->imgsize);
+    if (ctx->fpar != NULL) flash_params = (uint16_t) strtoul(ctx->fpar, 0, 0);
+  } else {
+    if (!chip_connect(ctx)) fail("Error connecting\n");
+    if (ctx->ovl != NULL) {
+      struct mem ovl = load_overlay(ctx, &ctx->ovladdr);
+      ctx->ovlbuf = ovl.ptr, ctx->ovllen = (size_t) ovl.len;
+    }
+    flash_params = flash_attach(ctx);
+  }
 
   // Iterate over arguments: FLASH_OFFSET FILENAME ...
   while (args[0]) {
-    if (has_suffix(args[0], ".hex")) {
-      // A .hex file is fed to us. Unhex it first into a temp dir
-      char file_list[8192], tmpdir[1024], *s = file_list;
-      size_t n;
-
+    if (has_suffix(args[0], ".hex") || has_suffix(args[0], ".bundle")) {
+      // A .hex or .bundle file is fed to us. Load its segments, flash each
+      struct seg *segs;
+      size_t i, nsegs;
       bool is_url = (strncmp(args[0], "http", 4) == 0);
       if (is_url) args[0] = download(args[0]);
 
-      snprintf(tmpdir, sizeof(tmpdir), "%s.tmp", args[0]);
-      unhex(args[0], tmpdir, file_list, sizeof(file_list));
-      // Now iterate over the unhexed files, and flash each
-      while ((n = strcspn(s, " ")) > 0) {
-        char *slash, *p = s + n;
-        while (*p == ' ') *p++ = '\0';
-        slash = strrchr(s, '/');
-        flashbin(ctx, flash_params, strtoul(slash ? slash + 1 : s, NULL, 0), s);
-        s = p;
+      nsegs = has_suffix(args[0], ".hex") ? hex_load(args[0], &segs)
+                                          : bundle_load(args[0], &segs);
+      for (i = 0; i < nsegs; i++) {
+        char name[1024];
+        snprintf(name, sizeof(name), "%s:%#lx", args[0],
+                 (unsigned long) segs[i].addr);
+        flashbuf(ctx, flash_params, segs[i].addr, segs[i].data, segs[i].len,
+                 name);
       }
+      segs_free(segs, nsegs);
       if (is_url) remove(args[0]);  // Remove downloaded file
-      rmrf(tmpdir);                 // Cleanup temp dir
       args += 1;                    // Move to next file
     } else if (args[1] != NULL) {
       bool is_url = (strncmp(args[0], "http", 4) == 0);
       if (is_url) args[1] = download(args[1]);
-      flashbin(ctx, flash_params, strtoul(args[0], NULL, 0), args[1]);
+      flashbin(ctx, flash_params, flash_addr(ctx, args[0], NULL), args[1]);
       if (is_url) remove(args[0]);  // Remove downloaded file
       args += 2;
     }
   }
 
+  if (ctx->ovlbuf != NULL) flash_overlay(ctx);
+  free(ctx->ovlbuf);
+
+  if (ctx->imgbuf != NULL) {
+    write_entire_file(ctx->img, ctx->imgbuf, ctx->imgsize);
+    printf("Flash image %s, %lu bytes\n", ctx->img,
+           (unsigned long) ctx->imgsize);
+    free(ctx->imgbuf);
+    return;
+  }
+
   {
     // Flash end
     uint32_t d3[] = {0};  // 0: reboot, 1: run user code
@@ -931,150 +2822,197 @@ static void flash(struct ctx *ctx, const char **args) {
   hard_reset(ctx->fd);
 }
 
-static unsigned long align_to(unsigned long n, unsigned to) {
-  return ((n + to - 1) / to) * to;
+// Compare flash regions with files, using on-device MD5
+static void verify(struct ctx *ctx, const char **args) {
+  uint16_t flash_params;
+  if (!chip_connect(ctx)) fail("Error connecting\n");
+  if (args[0] == NULL || args[1] == NULL) usage(ctx);
+  flash_params = flash_attach(ctx);
+  for (; args[0] != NULL && args[1] != NULL; args += 2) {
+    uint32_t addr = flash_addr(ctx, args[0], NULL);
+    struct mem mem = read_image(ctx, args[1], addr);
+    // Bootloader is patched when flashed, so patch it the same way
+    patch_image(ctx, flash_params, addr, mem.ptr, mem.len);
+    verify_region(ctx, addr, mem.ptr, mem.len, args[1]);
+    free(mem.ptr);
+  }
 }
 
-////////////////////////////////// mkbin command - ELF related functionality
+enum { BACKUP_BLOCK_SIZE = 65536 };  // Backup store keeps blocks of that size
 
-struct mem {
-  unsigned char *ptr;
-  int len;
-};
-
-struct Elf32_Ehdr {
-  unsigned char e_ident[16];
-  uint16_t e_type, e_machine;
-  uint32_t e_version, e_entry, e_phoff, e_shoff, e_flags;
-  uint16_t e_ehsize, e_phentsize, e_phnum, e_shentsize, e_shnum, e_shstrndx;
-};
+static void md5_to_hex(const uint8_t digest[16], char hex[33]) {
+  int i;
+  for (i = 0; i < 16; i++) sprintf(hex + i * 2, "%02x", digest[i]);
+}
 
-struct Elf32_Phdr {
-  uint32_t p_type, p_offset, p_vaddr, p_paddr;
-  uint32_t p_filesz, p_memsz, p_flags, p_align;
-};
+// Backup flash region into a content-addressed store. Every block is kept
+// in the store directory, in a file named by the block's MD5, and a manifest
+// lists the blocks of the region. Blocks that are already in the store are
+// not read from the device
+static void backup(struct ctx *ctx, const char **args) {
+  uint32_t i, n, base, size, nblocks, nread = 0;
+  uint8_t(*d)[16], mac[6] = {0, 0, 0, 0, 0, 0}, ff[16], digest[16], *buf;
+  char path[1024], hex[33], manifest[1024];
+  FILE *fp, *mf;
+  unsigned long t = now_ms();
 
-static struct mem read_entire_file(const char *path) {
-  struct mem mem;
-  FILE *fp = fopen(path, "rb");
-  if (fp == NULL) fail("Cannot open %s: %s\n", path, strerror(errno));
-  fseek(fp, 0, SEEK_END);
-  mem.len = ftell(fp);
-  rewind(fp);
-  mem.ptr = malloc(mem.len);
-  if (mem.ptr == NULL) fail("malloc(%d) failed\n", mem.len);
-  if (fread(mem.ptr, 1, mem.len, fp) != (size_t) mem.len) {
-    fail("fread(%s) failed: %s\n", path, strerror(errno));
+  if (!chip_connect(ctx)) fail("Error connecting\n");
+  if (args[0] == NULL || args[1] == NULL) usage(ctx);
+  flasher_start(ctx);
+  if (!has_md5(ctx)) fail("Can't do it on esp8266 without -stub\n");
+  base = strtoul(args[0], NULL, 0);
+  size = strtoul(args[1], NULL, 0);
+  nblocks = (size + BACKUP_BLOCK_SIZE - 1) / BACKUP_BLOCK_SIZE;
+  d = malloc(nblocks * 16 + 1);
+  buf = malloc(BACKUP_BLOCK_SIZE);
+  if (d == NULL || buf == NULL) fail("malloc failed\n");
+  read_mac(ctx, mac);
+  spiattach(ctx);
+  if (flash_md5_blocks(ctx, base, size, BACKUP_BLOCK_SIZE, d) != 0)
+    fail("Error: cannot get block digests\n");
+
+  mkdir(ctx->store, 0755);
+  snprintf(manifest, sizeof(manifest), "%s/%02x%02x%02x%02x%02x%02x.txt",
+           ctx->store, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  if (ctx->out != NULL) snprintf(manifest, sizeof(manifest), "%s", ctx->out);
+  if ((mf = fopen(manifest, "w")) == NULL)
+    fail("Cannot open %s: %s\n", manifest, strerror(errno));
+  fprintf(mf, "# %s %02x:%02x:%02x:%02x:%02x:%02x\n", ctx->chip.name, mac[0],
+          mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+  for (i = 0; i < nblocks; i++) {
+    uint32_t addr = base + i * BACKUP_BLOCK_SIZE;
+    n = size - i * BACKUP_BLOCK_SIZE;
+    if (n > BACKUP_BLOCK_SIZE) n = BACKUP_BLOCK_SIZE;
+    md5_to_hex(d[i], hex);
+    snprintf(path, sizeof(path), "%s/%s", ctx->store, hex);
+    if ((fp = fopen(path, "rb")) != NULL) {
+      fclose(fp);  // Already in the store
+    } else {
+      md5_ff(n, ff);
+      if (memcmp(ff, d[i], sizeof(ff)) == 0) {
+        memset(buf, 0xff, n);  // Blank block, no need to read
+      } else if (read_flash(ctx, addr, buf, n) != 0) {
+        fail("Error: flash read @ addr %#x\n", addr);
+      } else {
+        nread++;
+      }
+      md5(buf, n, digest);
+      if (memcmp(digest, d[i], sizeof(digest)) != 0)
+        fail("Error: block @ %#x changed while reading\n", addr);
+      write_entire_file(path, buf, n);
+    }
+    fprintf(mf, "%#x %u %s\n", addr, n, hex);
   }
-  fclose(fp);
-  return mem;
-}
-
-static int elf_get_num_segments(const struct mem *elf) {
-  struct Elf32_Ehdr *e = (struct Elf32_Ehdr *) elf->ptr;
-  return e->e_phnum;
+  fclose(mf);
+  free(buf);
+  free(d);
+  report_speed("Read", nread * BACKUP_BLOCK_SIZE, t);
+  printf("Backed up %u blocks, %u read from device, manifest %s\n", nblocks,
+         nread, manifest);
 }
 
-static uint32_t elf_get_entry_point(const struct mem *elf) {
-  return ((struct Elf32_Ehdr *) elf->ptr)->e_entry;
+// Restore flash from a backup manifest. Blocks that are already on the
+// device are not written
+static void restore(struct ctx *ctx, const char **args) {
+  char line[200], hex[33], path[1024];
+  uint32_t addr, size, nwritten = 0, nblocks = 0;
+  uint8_t digest[16];
+  FILE *mf;
+
+  if (args[0] == NULL) usage(ctx);
+  if ((mf = fopen(args[0], "r")) == NULL)
+    fail("Cannot open %s: %s\n", args[0], strerror(errno));
+  if (!chip_connect(ctx)) fail("Error connecting\n");
+  flash_attach(ctx);
+  while (fgets(line, sizeof(line), mf) != NULL) {
+    struct mem mem;
+    if (line[0] == '#' || sscanf(line, "%x %u %32s", &addr, &size, hex) != 3)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", ctx->store, hex);
+    mem = read_entire_file(path);
+    md5(mem.ptr, mem.len, digest);
+    md5_to_hex(digest, line);
+    if (strcmp(line, hex) != 0 || (uint32_t) mem.len != size)
+      fail("%s: corrupt block\n", path);
+    if (flash_cmp(ctx, addr, mem.ptr, mem.len) != 0) {
+      flashmem(ctx, addr, mem.ptr, mem.len, hex);
+      nwritten++;
+    }
+    nblocks++;
+    free(mem.ptr);
+  }
+  fclose(mf);
+  printf("Restored %u blocks, %u written\n", nblocks, nwritten);
+  {
+    uint32_t d3[] = {0};  // 0: reboot, 1: run user code
+    if (cmd(ctx, 4, d3, sizeof(d3), 0, 250)) fail("flash_end failed\n");
+  }
+  hard_reset(ctx->fd);
 }
 
-static struct Elf32_Phdr elf_get_phdr(const struct mem *elf, int no) {
-  struct Elf32_Ehdr *e = (struct Elf32_Ehdr *) elf->ptr;
-  struct Elf32_Phdr *h = (struct Elf32_Phdr *) (elf->ptr + e->e_phoff);
-  if (h->p_filesz == 0) no++;  // GCC-generated phdrs have empty 1st phdr
-  return h[no];
-}
 
-static int mkbin(const char *elf_path, const char *bin_path, struct ctx *ctx) {
-  struct mem elf = read_entire_file(elf_path);
-  FILE *bin_fp = fopen(bin_path, "w+b");
-  uint8_t common_hdr[] = {0xe9, 1, 0, 0};
-  uint8_t extended_hdr[] = {0xee, 0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-  uint8_t i, j, cs = 0xef, zero = 0, num_segments = elf_get_num_segments(&elf);
-  uint32_t entrypoint = elf_get_entry_point(&elf);
+////////////////////////////////// mkbin command - ELF related functionality
 
-  if (ctx->chip.id == CHIP_ID_ESP32_S2) {
-    extended_hdr[0] = 0x00;
-    extended_hdr[4] = 2;
-  }
-  if (ctx->chip.id == CHIP_ID_ESP32_C3_ECO_1_2 ||
-      ctx->chip.id == CHIP_ID_ESP32_C3_ECO3) {
-    extended_hdr[4] = 5;
-  }
+// Version of the mkbin output format. Bump it when mkimage() output changes,
+// so images cached by older esputil versions are not used
+#define MKBIN_VERSION 1
 
-  if (bin_fp == NULL) fail("Cannot open %s: %s\n", bin_path, strerror(errno));
-  if (elf.len < (int) sizeof(struct Elf32_Phdr)) fail("corrupt ELF file\n");
-  if (elf.ptr[4] != '\x01') fail("Not ELF32: %d\n", elf.ptr[4]);
-
-  // GCC generates 2 segments. TCC - 4, first two are .text and .data
-  // num_segments = 2;
-  common_hdr[1] = num_segments;
-  fwrite(common_hdr, 1, sizeof(common_hdr), bin_fp);      // Common header
-  fwrite(&entrypoint, 1, sizeof(entrypoint), bin_fp);     // Entry point
-  fwrite(extended_hdr, 1, sizeof(extended_hdr), bin_fp);  // Extended header
-  if (ctx->verbose)
-    printf("%s: %d segments found\n", elf_path, (int) num_segments);
-
-  // Iterate over segments
-  for (i = 0; i < num_segments; i++) {
-    struct Elf32_Phdr h = elf_get_phdr(&elf, i);
-    uint32_t load_address = h.p_vaddr;
-    uint32_t aligned_size = align_to(h.p_filesz, 4);
-    if (ctx->verbose) printf("  addr %x size %u\n", load_address, aligned_size);
-    fwrite(&load_address, 1, sizeof(load_address), bin_fp);
-    fwrite(&aligned_size, 1, sizeof(aligned_size), bin_fp);
-    fwrite(elf.ptr + h.p_offset, 1, h.p_filesz, bin_fp);
-    for (j = 0; j < aligned_size - h.p_filesz; j++) fputc(zero, bin_fp);
-    cs = checksum2(cs, elf.ptr + h.p_offset, h.p_filesz);
+// Convert ELF file into a flashable image file. With -cache DIR, images are
+// kept in DIR, keyed by MD5 of the ELF contents and the conversion settings,
+// and an unchanged ELF is not converted again
+static int mkbin(const char *elf_path, const char *bin_path, struct ctx *ctx) {
+  struct mem elf = elf_read(elf_path), img;
+  char path[1024], hex[33];
+  uint8_t digest[16], xip = ctx->xip, version = MKBIN_VERSION;
+  struct md5 m;
+  FILE *fp;
+
+  if (ctx->cache != NULL) {
+    md5_init(&m);
+    md5_update(&m, elf.ptr, (size_t) elf.len);
+    md5_update(&m, &ctx->chip.id, sizeof(ctx->chip.id));
+    md5_update(&m, &xip, sizeof(xip));
+    md5_update(&m, &version, sizeof(version));
+    md5_final(&m, digest);
+    md5_to_hex(digest, hex);
+    snprintf(path, sizeof(path), "%s/%s.bin", ctx->cache, hex);
+    if ((fp = fopen(path, "rb")) != NULL) {
+      fclose(fp);
+      img = read_entire_file(path);
+      write_entire_file(bin_path, img.ptr, (size_t) img.len);
+      if (ctx->verbose) printf("%s: cached %s\n", elf_path, path);
+      free(img.ptr);
+      free(elf.ptr);
+      return EXIT_SUCCESS;
+    }
   }
 
-  {
-    // Pad to 16 bytes and write checksum
-    long ofs = ftell(bin_fp), aligned_ofs = align_to(ofs + 1, 16);
-    for (i = 0; i < aligned_ofs - ofs - 1; i++) fputc(zero, bin_fp);
-    fputc(cs, bin_fp);
+  img = mkimage(ctx, &elf, elf_path);
+  write_entire_file(bin_path, img.ptr, (size_t) img.len);
+  if (ctx->cache != NULL) {
+    mkdir(ctx->cache, 0755);
+    write_entire_file(path, img.ptr, (size_t) img.len);
   }
-
-  fclose(bin_fp);
+  free(img.ptr);
   free(elf.ptr);
   return EXIT_SUCCESS;
 }
 ///////////////////////////////////////////////// End of mkbin command
 
-static void printhexline(int type, int len, int addr, int *buf) {
-  unsigned i, cs = type + len + ((addr >> 8) & 255) + (addr & 255);
-  printf(":%02x%04x%02x", len, addr & 0xffff, type);
-  for (i = 0; i < (unsigned) len; i++) cs += buf[i], printf("%02x", buf[i]);
-  printf("%02x\n", (~cs + 1) & 255);
-}
-
-static void printhexhiaddrline(unsigned long addr) {
-  int buf[2] = {(addr >> 24) & 255, (addr >> 16) & 255};
-  printhexline(4, 2, 0, buf);
-}
-
-static int mkhex(const char **args) {
+// Pack binary files into a single Intel HEX file
+static int mkhex(struct ctx *ctx, const char **args) {
+  FILE *fp = ctx->out == NULL ? stdout : fopen(ctx->out, "w");
+  uint32_t upper = ~0U;
+  if (fp == NULL) fail("Cannot open %s: %s\n", ctx->out, strerror(errno));
   for (; args[0] && args[1]; args += 2) {
-    unsigned long addr = strtoul(args[0], NULL, 0);
-    FILE *fp = fopen(args[1], "rb");
-    int c, n = 0, buf[16];
-    if (fp == NULL) return fail("ERROR: cannot open %s\n", args[1]);
-    // if (addr >= 0xffff && (addr & 0xffff)) printhexhiaddrline(addr);
-    printhexhiaddrline(addr);
-    for (;;) {
-      if ((c = fgetc(fp)) != EOF) buf[n++] = c;
-      if (n >= (int) (sizeof(buf) / sizeof(buf[0])) || c == EOF) {
-        if (addr >= 0xffff && !(addr & 0xffff)) printhexhiaddrline(addr);
-        if (n > 0) printhexline(0, n, addr & 0xffff, buf);
-        addr += n;
-        n = 0;
-      }
-      if (c == EOF) break;
-    }
-    fclose(fp);
+    struct mem mem = read_entire_file(args[1]);
+    writehex(fp, (uint32_t) strtoul(args[0], NULL, 0), mem.ptr,
+             (size_t) mem.len, (size_t) ctx->recsize, &upper);
+    free(mem.ptr);
   }
-  printhexline(1, 0, 0, NULL);
+  hexrecord(fp, 1, 0, NULL, 0);
+  if (fp != stdout) fclose(fp);
   return EXIT_SUCCESS;
 }
 
@@ -1102,6 +3040,11 @@ int main(int argc, const char **argv) {
   ctx.baud = getenv("BAUD");          // Serial port baud rate
   ctx.fpar = getenv("FLASH_PARAMS");  // Flash parameters
   ctx.fspi = getenv("FLASH_SPI");     // Flash SPI pins
+  ctx.ovl = getenv("OVERLAY");        // Per-device overlay
+  ctx.store = getenv("STORE_DIR");    // Backup store directory
+  ctx.cache = getenv("MKBIN_CACHE");  // mkbin image cache directory
+  ctx.stubfile = getenv("STUB");      // Flasher stub ELF
+  ctx.pt = getenv("PARTITIONS");      // Partition table
   ctx.verbose = getenv("V") != NULL;  // Verbose output
   ctx.slip.buf = slipbuf;             // Set SLIP context - buffer
   ctx.slip.size = sizeof(slipbuf);    // Buffer size
@@ -1118,6 +3061,9 @@ int main(int argc, const char **argv) {
   if (ctx.baud == NULL) ctx.baud = "115200";  // Default baud rate
   if (temp_dir == NULL) temp_dir = "tmp";     // Default temp dir
   if (udp_port == NULL) udp_port = "1999";    // Default UDP_PORT
+  if (ctx.store == NULL) ctx.store = "store";  // Default backup store
+  ctx.recsize = 16;                            // Default HEX record size
+  ctx.imgsize = 4 * 1024 * 1024;               // Default flash image size
 
   // Parse options
   for (i = 1; i < argc; i++) {
@@ -1129,12 +3075,51 @@ int main(int argc, const char **argv) {
       ctx.fpar = argv[++i];
     } else if (strcmp(argv[i], "-fspi") == 0 && i + 1 < argc) {
       ctx.fspi = argv[++i];
+    } else if (strcmp(argv[i], "-ov") == 0 && i + 1 < argc) {
+      ctx.ovl = argv[++i];
     } else if (strcmp(argv[i], "-chip") == 0 && i + 1 < argc) {
       set_chip_id(&ctx, argv[++i]);
     } else if (strcmp(argv[i], "-tmp") == 0 && i + 1 < argc) {
       temp_dir = argv[++i];
     } else if (strcmp(argv[i], "-udp") == 0 && i + 1 < argc) {
       udp_port = argv[++i];
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      ctx.out = argv[++i];
+    } else if (strcmp(argv[i], "-store") == 0 && i + 1 < argc) {
+      ctx.store = argv[++i];
+    } else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc) {
+      ctx.cache = argv[++i];
+    } else if (strcmp(argv[i], "-img") == 0 && i + 1 < argc) {
+      ctx.img = argv[++i];
+    } else if (strcmp(argv[i], "-fsize") == 0 && i + 1 < argc) {
+      char *end;
+      ctx.imgsize = strtoul(argv[++i], &end, 0);
+      if (toupper((unsigned char) *end) == 'K') ctx.imgsize *= 1024;
+      if (toupper((unsigned char) *end) == 'M') ctx.imgsize *= 1024 * 1024;
+      if (ctx.imgsize == 0) usage(&ctx);
+    } else if (strcmp(argv[i], "-pt") == 0 && i + 1 < argc) {
+      ctx.pt = argv[++i];
+    } else if (strcmp(argv[i], "-stub") == 0 && i + 1 < argc) {
+      ctx.stubfile = argv[++i];
+    } else if (strcmp(argv[i], "-interval") == 0 && i + 1 < argc) {
+      ctx.interval = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      ctx.recsize = atoi(argv[++i]);
+      if (ctx.recsize < 1 || ctx.recsize > 255) usage(&ctx);
+    } else if (strcmp(argv[i], "-full") == 0) {
+      ctx.full = true;
+    } else if (strcmp(argv[i], "-json") == 0) {
+      ctx.json = true;
+    } else if (strcmp(argv[i], "-sparse") == 0) {
+      ctx.sparse = true;
+    } else if (strcmp(argv[i], "-resume") == 0) {
+      ctx.resume = true;
+    } else if (strcmp(argv[i], "-ifchanged") == 0) {
+      ctx.ifchanged = true;
+    } else if (strcmp(argv[i], "-verify") == 0) {
+      ctx.verify = true;
+    } else if (strcmp(argv[i], "-xip") == 0) {
+      ctx.xip = true;
     } else if (strcmp(argv[i], "-v") == 0) {
       ctx.verbose = true;
     } else if (argv[i][0] == '-') {
@@ -1151,10 +3136,25 @@ int main(int argc, const char **argv) {
     if (!command[1] || !command[2]) usage(&ctx);
     return mkbin(command[1], command[2], &ctx);
   } else if (strcmp(*command, "mkhex") == 0) {
-    return mkhex(&command[1]);
+    return mkhex(&ctx, &command[1]);
   } else if (strcmp(*command, "unhex") == 0) {
-    char file_list[500];
-    return unhex(command[1], temp_dir, file_list, sizeof(file_list));
+    struct seg *segs;
+    size_t nsegs;
+    if (!command[1]) usage(&ctx);
+    nsegs = hex_load(command[1], &segs);
+    return segs_save(segs, nsegs, temp_dir);
+  } else if (strcmp(*command, "mkbundle") == 0) {
+    if (!command[1]) usage(&ctx);
+    return mkbundle(command[1], &command[2]);
+  } else if (strcmp(*command, "unbundle") == 0) {
+    struct seg *segs;
+    size_t nsegs;
+    if (!command[1]) usage(&ctx);
+    nsegs = bundle_load(command[1], &segs);
+    return segs_save(segs, nsegs, temp_dir);
+  } else if (strcmp(*command, "flash") == 0 && ctx.img != NULL) {
+    flash(&ctx, &command[1]);  // Compose flash image file
+    return EXIT_SUCCESS;
   }
 
   // Commands that require serial port. First, open serial.
@@ -1167,8 +3167,20 @@ int main(int argc, const char **argv) {
     info(&ctx);
   } else if (strcmp(*command, "flash") == 0) {
     flash(&ctx, &command[1]);
+  } else if (strcmp(*command, "backup") == 0) {
+    backup(&ctx, &command[1]);
+  } else if (strcmp(*command, "restore") == 0) {
+    restore(&ctx, &command[1]);
+  } else if (strcmp(*command, "verify") == 0) {
+    verify(&ctx, &command[1]);
   } else if (strcmp(*command, "readmem") == 0) {
     readmem(&ctx, &command[1]);
+  } else if (strcmp(*command, "erase") == 0) {
+    erase(&ctx, &command[1]);
+  } else if (strcmp(*command, "run") == 0) {
+    run(&ctx, &command[1]);
+  } else if (strcmp(*command, "sample") == 0) {
+    sample(&ctx, &command[1]);
   } else if (strcmp(*command, "readflash") == 0) {
     readflash(&ctx, &command[1]);
   } else if (strcmp(*command, "monitor") == 0) {
@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+# Minimal ESP ROM and flasher stub protocol emulator, talking over a pty.
+# Used by test/stub_test.sh. Environment variables:
+#   EMU_CHIP        chip ID to report, hex. Default: ESP32-C3 ECO3
+#   EMU_FLASH       file with initial flash contents
+#   EMU_FLASH_SIZE  flash size, default 1MB
+#   EMU_DUMP        file to save flash contents to, before replying to a
+#                   command that changed them
+#   EMU_STUB        if set, MEM_END that starts a program switches to the stub
+#                   protocol, as if the flasher stub was uploaded
+#   EMU_PORT        file to write the pty name to
+#   EMU_BAD_MD5     number of stub READ_FLASH digests to corrupt, default 0
+import os, struct, hashlib, tty, select, sys
+
+CHIP = int(os.environ.get("EMU_CHIP", "0x1b31506f"), 16)
+ESP8266 = 0xFFF0C101
+FLASH_SIZE = int(os.environ.get("EMU_FLASH_SIZE", str(1024 * 1024)), 0)
+flash = bytearray(b"\xff" * FLASH_SIZE)
+if os.environ.get("EMU_FLASH"):
+    d = open(os.environ["EMU_FLASH"], "rb").read()[:FLASH_SIZE]
+    flash[: len(d)] = d
+regs = {0x40001000: CHIP, 0x60008844: 0x11223344, 0x60008848: 0x00005566}
+stub = False
+wr = None
+dirty = False
+bad_md5 = int(os.environ.get("EMU_BAD_MD5", "0"))
+
+m, s = os.openpty()
+tty.setraw(m)
+tty.setraw(s)
+with open(os.environ.get("EMU_PORT", "emu.port"), "w") as f:
+    f.write(os.ttyname(s))
+
+
+def send(frame):
+    out = bytearray([0xC0])
+    for b in frame:
+        if b == 0xC0:
+            out += b"\xdb\xdc"
+        elif b == 0xDB:
+            out += b"\xdb\xdd"
+        else:
+            out.append(b)
+    out.append(0xC0)
+    os.write(m, bytes(out))
+
+
+def dump():
+    # Save flash before the reply, since the client may exit right after it.
+    # Rename, so readers never see a partially written dump
+    global dirty
+    path = os.environ.get("EMU_DUMP")
+    if path and dirty:
+        with open(path + ".tmp", "wb") as f:
+            f.write(flash)
+        os.replace(path + ".tmp", path)
+    dirty = False
+
+
+def reply(op, val=0, data=b"", err=0):
+    dump()
+    # Stub and ESP8266 ROM send 2 status bytes, other ROMs send 4
+    st = bytes([1 if err else 0, err])
+    if not stub and CHIP != ESP8266:
+        st += b"\0\0"
+    send(struct.pack("<BBHI", 1, op, len(data) + len(st), val) + data + st)
+
+
+def handle(pkt):
+    global stub, wr, dirty, bad_md5
+    if len(pkt) < 8:
+        return
+    _, op, ln, cs = struct.unpack("<BBHI", pkt[:8])
+    d = pkt[8 : 8 + ln]
+    if op == 8:  # SYNC
+        reply(op)
+    elif op == 10:  # READ_REG
+        (a,) = struct.unpack("<I", d[:4])
+        if CHIP == ESP8266 and 0x40200000 <= a < 0x40200000 + FLASH_SIZE:
+            a -= 0x40200000
+            reply(op, struct.unpack("<I", flash[a : a + 4])[0])
+        else:
+            reply(op, regs.get(a, 0))
+    elif op == 9:  # WRITE_REG
+        a, v = struct.unpack("<II", d[:8])
+        regs[a] = v
+        reply(op)
+    elif op in (11, 13, 15):  # SPI_SET_PARAMS, SPI_ATTACH, CHANGE_BAUD
+        reply(op)
+    elif op == 14 and not stub:  # READ_FLASH_SLOW
+        a, n = struct.unpack("<II", d[:8])
+        reply(op, 0, bytes(flash[a : a + n]))
+    elif op == 2:  # FLASH_BEGIN
+        size, nb, bs, off = struct.unpack("<IIII", d[:16])
+        if stub and bs != 16384:
+            sys.exit("stub FLASH_BEGIN: block size %d, want 16384" % bs)
+        er = (size + 4095) // 4096 * 4096
+        s0 = off // 4096 * 4096
+        flash[s0 : off + er] = b"\xff" * (off + er - s0)
+        wr = [off, bs]
+        dirty = True
+        reply(op)
+    elif op == 3:  # FLASH_DATA
+        n, seq = struct.unpack("<II", d[:8])
+        data = d[16 : 16 + n]
+        c = 0xEF
+        for b in data:
+            c ^= b
+        if c != cs & 0xFF:
+            reply(op, err=7)
+            return
+        a = wr[0] + seq * wr[1]
+        flash[a : a + n] = data
+        dirty = True
+        reply(op)
+    elif op == 4:  # FLASH_END
+        reply(op)
+    elif op == 0x13:  # SPI_FLASH_MD5. ROM returns hex string, stub raw MD5
+        a, n = struct.unpack("<II", d[:8])
+        h = hashlib.md5(bytes(flash[a : a + n]))
+        reply(op, 0, h.digest() if stub else h.hexdigest().encode())
+    elif op in (5, 7):  # MEM_BEGIN, MEM_DATA
+        reply(op)
+    elif op == 6:  # MEM_END
+        flag, entry = struct.unpack("<II", d[:8])
+        reply(op)
+        if flag == 0 and os.environ.get("EMU_STUB"):
+            stub = True
+            send(b"OHAI")
+    elif op == 0xD0 and stub:  # ERASE_FLASH
+        flash[:] = b"\xff" * FLASH_SIZE
+        dirty = True
+        reply(op)
+    elif op == 0xD1 and stub:  # ERASE_REGION
+        a, n = struct.unpack("<II", d[:8])
+        flash[a : a + n] = b"\xff" * n
+        dirty = True
+        reply(op)
+    elif op == 0xD2 and stub:  # READ_FLASH: data frames, acks, then MD5
+        a, n, bs, inflight = struct.unpack("<IIII", d[:16])
+        reply(op)
+        sent = acked = 0
+        while acked < n:
+            while sent < n and sent - acked < bs * inflight:
+                k = min(bs, n - sent)
+                send(bytes(flash[a + sent : a + sent + k]))
+                sent += k
+            fr = readframe()
+            if fr is None:
+                return
+            (acked,) = struct.unpack("<I", fr[:4])
+        h = hashlib.md5(bytes(flash[a : a + n])).digest()
+        if bad_md5 > 0:
+            h, bad_md5 = bytes(16), bad_md5 - 1
+        send(h)
+    else:
+        reply(op, err=5)
+
+
+inframe = esc = False
+cur = bytearray()
+frames = []
+
+
+def feed(data):
+    global inframe, cur, esc
+    for b in data:
+        if b == 0xC0:
+            if inframe and cur:
+                frames.append(bytes(cur))
+            inframe, cur = True, bytearray()
+        elif esc:
+            cur.append(0xC0 if b == 0xDC else 0xDB)
+            esc = False
+        elif b == 0xDB:
+            esc = True
+        elif inframe:
+            cur.append(b)
+
+
+def readframe():
+    while not frames:
+        r, _, _ = select.select([m], [], [], 5)
+        if not r:
+            return None
+        try:
+            feed(os.read(m, 65536))
+        except OSError:  # No client connected to the pty yet
+            select.select([], [], [], 0.05)
+    return frames.pop(0)
+
+
+while True:
+    f = readframe()
+    if f is None:
+        continue
+    handle(f)
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Test flasher stub support against the protocol emulator, test/emu.py.
+# Usage: test/stub_test.sh [PATH_TO_ESPUTIL]
+set -e
+ESPUTIL=$(realpath ${1:-./esputil})
+EMU_PY=$(realpath $(dirname $0)/emu.py)
+DIR=$(mktemp -d)
+cd $DIR
+trap 'kill $EMU 2>/dev/null; rm -rf $DIR' EXIT
+
+# Dummy stub ELF: a single segment in RAM. The emulator does not run it,
+# it just switches to the stub protocol on MEM_END
+python3 - <<'PY'
+import struct
+code = bytes(range(256)) * 8
+eh = bytearray(52)
+eh[:7] = b"\x7fELF\x01\x01\x01"
+struct.pack_into("<HHIIIIIHHHHHH", eh, 16, 2, 0xF3, 1, 0x40380000, 52, 0, 0,
+                 52, 32, 1, 40, 0, 0)
+ph = struct.pack("<8I", 1, 84, 0x40380000, 0x40380000, len(code), len(code),
+                 5, 4)
+open("stub.elf", "wb").write(eh + ph + code)
+PY
+head -c 1048576 /dev/urandom > flash.bin
+head -c 100000 /dev/urandom > data.bin
+
+EMU_STUB=1 EMU_BAD_MD5=1 EMU_FLASH=flash.bin EMU_DUMP=dump.bin EMU_PORT=port \
+  python3 $EMU_PY >/dev/null &
+EMU=$!
+for i in $(seq 50); do [ -s port ] && break; sleep 0.1; done
+[ -s port ] || { echo "Emulator did not start"; exit 1; }
+run() { $ESPUTIL -p $(cat port) -stub stub.elf "$@" </dev/null; }
+region() { dd if=$1 bs=4096 skip=$(($2 / 4096)) count=$(($3 / 4096)) 2>/dev/null; }
+blank() { [ $(wc -c < $2) -eq $1 ] && [ $(tr -d '\377' < $2 | wc -c) -eq 0 ]; }
+
+echo "== READ_FLASH (0xd2), bad MD5 is not marked as fetched"
+if run -o out.bin readflash 0 0x40000; then exit 1; fi
+[ -f out.bin.map ]
+run -o out.bin -resume readflash 0 0x40000 2>log.txt
+grep -q "Read 262144 bytes" log.txt
+region flash.bin 0 0x40000 | cmp - out.bin
+[ ! -f out.bin.map ]
+
+echo "== FLASH_DATA with 16KB blocks, stub MD5"
+run -verify flash 0x20000 data.bin
+dd if=dump.bin bs=1 skip=$((0x20000)) count=100000 2>/dev/null | cmp - data.bin
+
+echo "== ERASE_REGION (0xd1)"
+run erase 0x80000 0x2000
+region dump.bin 0x80000 0x2000 > region.bin
+blank 8192 region.bin
+
+echo "== ERASE_FLASH (0xd0)"
+run erase all
+blank 1048576 dump.bin
+
+echo "All stub tests passed"